@@ -12,13 +12,10 @@
 #include <stdio.h>
 #include <string.h>
 #include <sys/types.h>
-#include <dirent.h>
-#include <errno.h>
-#include <sys/stat.h>
-#include <dlfcn.h>
 
 #include <ladspa.h>
 #include "dssi.h"
+#include "plugin_index.h"
 
 struct duplicate_list {
     struct duplicate_list *next;
@@ -28,6 +25,7 @@ struct duplicate_list {
 struct duplicate_list *dup_list = NULL;
 
 int verbose = 0;
+int machine = 0;
 
 void
 check_for_duplicates(const char *filename)
@@ -62,125 +60,135 @@ free_dup_list(void)
 }
 
 void
-list_dssi_plugins(DSSI_Descriptor_Function descriptor_function)
+list_dssi_plugins(dssi_index_library_t *library)
 {
     int i;
-    const DSSI_Descriptor *descriptor;
 
-    for (i = 0; (descriptor = descriptor_function(i)); i++)
-        printf("\t%-16s  %s\n", descriptor->LADSPA_Plugin->Label, 
-                                descriptor->LADSPA_Plugin->Name);
+    for (i = 0; i < library->pluginCount; i++)
+        printf("\t%-16s  %s\n", library->plugins[i].label,
+                                library->plugins[i].name);
 
     if (verbose && i == 0)
         printf("-- odd ... no plugins found within this shared object\n");
 }
 
 void
-list_ladspa_plugins(LADSPA_Descriptor_Function descriptor_function)
+list_ladspa_plugins(dssi_index_library_t *library)
 {
     int i;
-    const LADSPA_Descriptor *descriptor;
 
-    for (i = 0; (descriptor = descriptor_function(i)); i++)
-        printf("\t%-16s  (%lu) %s\n", descriptor->Label, descriptor->UniqueID, descriptor->Name);
+    for (i = 0; i < library->pluginCount; i++)
+        printf("\t%-16s  (%lu) %s\n", library->plugins[i].label,
+               library->plugins[i].uniqueID, library->plugins[i].name);
 
     if (verbose && i == 0)
         printf("-- odd ... no plugins found within this shared object\n");
 }
 
+/* One tab-separated line per plugin, GUI or library that couldn't be
+ * loaded:
+ *   dssi|ladspa <path> <label> <unique ID> <ports> <programs> <name>
+ *   gui <path> <GUI path>
+ *   error <path> <message> */
 void
-list_directory(char *directory)
+list_machine_readable(dssi_index_library_t *library)
+{
+    int i;
+
+    if (library->type == DSSI_INDEX_NONE) {
+        if (library->error)
+            printf("error\t%s\t%s\n", library->path, library->error);
+        return;
+    }
+    for (i = 0; i < library->pluginCount; i++)
+        printf("%s\t%s\t%s\t%lu\t%lu\t%d\t%s\n",
+               library->type == DSSI_INDEX_DSSI ? "dssi" : "ladspa",
+               library->path, library->plugins[i].label,
+               library->plugins[i].uniqueID, library->plugins[i].portCount,
+               library->plugins[i].programCount, library->plugins[i].name);
+    for (i = 0; i < library->guiCount; i++)
+        printf("gui\t%s\t%s\n", library->path, library->guis[i]);
+}
+
+void
+list_directory(dssi_index_t *index, char *directory)
 {
     int directory_length = strlen(directory);
-    DIR *dir;
-    struct dirent *dirent;
-    char *filename;
-    struct stat statbuf;
-    void *handle;
+    dssi_index_library_t *library;
     int found = 0;
 
     if (directory_length == 0) {
         if (verbose) printf("-- warning: skipping zero-length element in DSSI_PATH\n");
         return;
     }
-    if (directory[directory_length - 1] == '/')
-        directory[directory_length - 1] = 0; /* slash gets added again below */
+    if (directory_length > 1 && directory[directory_length - 1] == '/')
+        directory[directory_length - 1] = 0;
+
+    if (verbose && !machine) printf("-- scanning directory %s\n", directory);
 
-    dir = opendir(directory);
-    if (!dir) {
+    /* only libraries that are new or have changed since the index
+     * was written get loaded */
+    if (dssi_index_scan_directory(index, directory)) {
         if (verbose) printf("-- warning: couldn't open DSSI_PATH directory element '%s'\n", directory);
         return;
     }
 
-    if (verbose) printf("-- scanning directory %s\n", directory);
-
-    while ((dirent = readdir(dir)) != NULL) {
+    for (library = index->libraries; library; library = library->next) {
 
-        if (!strcmp(dirent->d_name, ".") || !strcmp(dirent->d_name, ".."))
+        if (!dssi_index_in_directory(library, directory))
             continue;
 
-        filename = malloc(directory_length + strlen(dirent->d_name) + 2);
-        sprintf(filename, "%s/%s", directory, dirent->d_name);
-
-        if (stat(filename, &statbuf)) {
-            if (verbose)
-                printf("-- warning: couldn't stat file '%s': %s\n", filename, strerror(errno));
-            free(filename);
-            continue;
-        }
-        if (S_ISDIR(statbuf.st_mode)) { /* silently skip subdirectories */
-            free(filename);
+        if (machine) {
+            list_machine_readable(library);
             continue;
         }
 
-        handle = dlopen(filename, RTLD_LAZY);
-        if (handle) {
-            DSSI_Descriptor_Function dssi_descriptor_function;
-            LADSPA_Descriptor_Function ladspa_descriptor_function;
+        if (library->type == DSSI_INDEX_NONE) {
+            int len = strlen(library->filename);
 
-            if (verbose)
-                check_for_duplicates(dirent->d_name);
-
-            dssi_descriptor_function = (DSSI_Descriptor_Function)dlsym(handle, "dssi_descriptor");
-            ladspa_descriptor_function = (LADSPA_Descriptor_Function)dlsym(handle, "ladspa_descriptor");
-
-            if (dssi_descriptor_function) {
-                printf("%s\n", filename);
-                list_dssi_plugins(dssi_descriptor_function);
-                found++;
-            } else if (ladspa_descriptor_function) {
-                printf("%s (LADSPA-only)\n", filename);
-                list_ladspa_plugins(ladspa_descriptor_function);
+            if (len > 4 && !strcmp(library->filename + len - 3, ".la")) {  /* libtool *.la file */
+                /* if (verbose) printf("-- skipping file '%s'\n", library->path); */
+            } else if (library->error) {
+                if (verbose)
+                    printf("-- warning: couldn't load file '%s': %s\n", library->path, library->error);
             } else {
                 if (verbose)
-                    printf("-- warning: shared object '%s' is neither a LADSPA nor DSSI plugin\n", filename);
+                    printf("-- warning: shared object '%s' is neither a LADSPA nor DSSI plugin\n", library->path);
             }
-            dlclose(handle);
-        } else { /* not a library */
-            int len = strlen(dirent->d_name);
+            continue;
+        }
 
-            if (len > 4 && !strcmp(dirent->d_name + len - 3, ".la")) {  /* libtool *.la file */
-                /* if (verbose) printf("-- skipping file '%s'\n", filename); */
-            } else
-                if (verbose)
-                    printf("-- warning: couldn't dlopen file '%s': %s\n", filename, dlerror());
+        if (verbose)
+            check_for_duplicates(library->filename);
+
+        if (library->type == DSSI_INDEX_DSSI) {
+            printf("%s\n", library->path);
+            list_dssi_plugins(library);
+            found++;
+        } else {
+            printf("%s (LADSPA-only)\n", library->path);
+            list_ladspa_plugins(library);
         }
-        free(filename);
     }
 
-    closedir(dir);
-
-    if (verbose && found == 0)
+    if (verbose && !machine && found == 0)
         printf("-- odd ... no DSSI plugins were found in this directory\n");
 }
 
 void
 usage(const char *program_name)
 {
-    fprintf(stderr, "usage: %s [-v|--verbose]\n", program_name);
+    fprintf(stderr, "usage: %s [-v|--verbose] [-r|--rescan] [-m|--machine] [-j <jobs>] [-t <seconds>]\n", program_name);
     fprintf(stderr, "Scan the directories listed in environment variable DSSI_PATH, and list\n");
     fprintf(stderr, "the DSSI plugins found therein.  Optional arguments:\n");
     fprintf(stderr, "  -v, --verbose    describe the scan and error conditions more verbosely.\n");
+    fprintf(stderr, "  -r, --rescan     load every library again, rather than trusting the plugin\n");
+    fprintf(stderr, "                   index for those that haven't changed.\n");
+    fprintf(stderr, "  -m, --machine    list one plugin per line, in tab-separated fields.\n");
+    fprintf(stderr, "  -j <jobs>        load up to this many libraries at once, each in its own\n");
+    fprintf(stderr, "                   process (default one per CPU; 0 loads them in this one.)\n");
+    fprintf(stderr, "  -t <seconds>     give up on a library that takes longer than this to load\n");
+    fprintf(stderr, "                   (default 10.)\n");
 
     exit(1);
 }
@@ -188,16 +196,34 @@ usage(const char *program_name)
 int 
 main(int argc, char *argv[])
 {
-    char *path, *pathtmp, *element;
+    char *path, *pathtmp, *element, *index_file;
+    dssi_index_t *index;
+    int rescan = 0, jobs = -1, timeout = 10;
+    int i;
 
-    while (argc > 1) {
-        argc--;
-        if (!strcmp(argv[argc], "-v") || !strcmp(argv[argc], "--verbose"))
+    for (i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-v") || !strcmp(argv[i], "--verbose"))
             verbose = 1;
+        else if (!strcmp(argv[i], "-r") || !strcmp(argv[i], "--rescan"))
+            rescan = 1;
+        else if (!strcmp(argv[i], "-m") || !strcmp(argv[i], "--machine"))
+            machine = 1;
+        else if (!strcmp(argv[i], "-j") && i < argc - 1 && atoi(argv[i + 1]) >= 0)
+            jobs = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "-t") && i < argc - 1 && atoi(argv[i + 1]) > 0)
+            timeout = atoi(argv[++i]);
         else
             usage(argv[0]); /* does not return */
     }
 
+    index_file = dssi_index_default_file();
+    index = dssi_index_load(rescan ? NULL : index_file);
+    if (rescan && index_file) {
+        index->file = strdup(index_file);
+        index->changed = 1;
+    }
+    dssi_index_set_scanning(index, jobs >= 0 ? jobs : index->workers, timeout);
+
     path = getenv("DSSI_PATH");
     if (!path) {
         path = "/usr/local/lib/dssi:/usr/lib/dssi";
@@ -208,10 +234,15 @@ main(int argc, char *argv[])
     pathtmp = path;
     while ((element = strtok(pathtmp, ":")) != 0) {
         pathtmp = NULL;
-        list_directory(element);
+        list_directory(index, element);
     }
     free(path);
 
+    if (dssi_index_save(index) && verbose)
+        printf("-- warning: couldn't write plugin index '%s'\n", index_file);
+    dssi_index_free(index);
+    free(index_file);
+
     free_dup_list();
 
     return 0;
@@ -0,0 +1,132 @@
+/* -*- c-basic-offset: 4 -*-  vi:set ts=8 sts=4 sw=4: */
+
+/* event_ring.h
+ *
+ * DSSI Soft Synth Interface
+ *
+ * A wait-free single-producer, single-consumer ring of ALSA sequencer
+ * events.  jack-dssi-host gives each thread that produces MIDI its
+ * own ring, so the audio thread never contends with a producer and
+ * never sees an event before the producer has finished writing it.
+ *
+ * The read and write indices run freely and are only reduced modulo
+ * the ring size when indexing, so that a full ring (write - read ==
+ * size) and an empty one (write == read) can be told apart exactly.
+ */
+
+/*
+ * Copyright 2004, 2009 Chris Cannam, Steve Harris and Sean Bolton.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software
+ * for any purpose is hereby granted without fee, provided that the
+ * above copyright notice and this permission notice are included in
+ * all copies or substantial portions of the software.
+ */
+
+#ifndef _EVENT_RING_H
+#define _EVENT_RING_H
+
+#include <alsa/seq_event.h>
+
+typedef struct _d3h_event_ring_t d3h_event_ring_t;
+
+struct _d3h_event_ring_t {
+    /* written only by the producer */
+    unsigned int     writeIndex;
+    unsigned long    dropped;     /* events refused because the ring was full */
+    char             pad[64];     /* keep the indices on separate cache lines */
+    /* written only by the consumer */
+    unsigned int     readIndex;
+    /* fixed at initialisation */
+    unsigned int     size;        /* must be 2^n */
+    snd_seq_event_t *events;
+};
+
+static inline void
+d3h_event_ring_init(d3h_event_ring_t *ring, snd_seq_event_t *buffer,
+                    unsigned int size)
+{
+    ring->writeIndex = 0;
+    ring->dropped = 0;
+    ring->readIndex = 0;
+    ring->size = size;
+    ring->events = buffer;
+}
+
+/* Producer side.  Returns 0 on success, or -1 (counting the event as
+ * dropped) if the ring is full. */
+static inline int
+d3h_event_ring_write(d3h_event_ring_t *ring, const snd_seq_event_t *ev)
+{
+    unsigned int w = ring->writeIndex;
+    unsigned int r = __atomic_load_n(&ring->readIndex, __ATOMIC_ACQUIRE);
+
+    if (w - r == ring->size) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    ring->events[w & (ring->size - 1)] = *ev;
+    __atomic_store_n(&ring->writeIndex, w + 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Producer side.  As d3h_event_ring_write(), but also refuses (and
+ * counts as dropped) the event if it would leave no more than reserve
+ * slots free, keeping those for more important events. */
+static inline int
+d3h_event_ring_write_reserved(d3h_event_ring_t *ring, const snd_seq_event_t *ev,
+                              unsigned int reserve)
+{
+    unsigned int r = __atomic_load_n(&ring->readIndex, __ATOMIC_ACQUIRE);
+
+    if (ring->size - (ring->writeIndex - r) <= reserve) {
+        __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+        return -1;
+    }
+    return d3h_event_ring_write(ring, ev);
+}
+
+/* Producer side: number of free slots. */
+static inline unsigned int
+d3h_event_ring_write_space(d3h_event_ring_t *ring)
+{
+    return ring->size - (ring->writeIndex -
+                         __atomic_load_n(&ring->readIndex, __ATOMIC_ACQUIRE));
+}
+
+/* Consumer side.  Returns the oldest unread event, or NULL if the ring
+ * is empty.  The event stays owned by the consumer, which may modify
+ * it in place, until d3h_event_ring_advance() is called. */
+static inline snd_seq_event_t *
+d3h_event_ring_peek(d3h_event_ring_t *ring)
+{
+    unsigned int r = ring->readIndex;
+
+    if (__atomic_load_n(&ring->writeIndex, __ATOMIC_ACQUIRE) == r) {
+        return NULL;
+    }
+    return &ring->events[r & (ring->size - 1)];
+}
+
+/* Consumer side: number of events waiting. */
+static inline unsigned int
+d3h_event_ring_read_space(d3h_event_ring_t *ring)
+{
+    return __atomic_load_n(&ring->writeIndex, __ATOMIC_ACQUIRE) - ring->readIndex;
+}
+
+/* Consumer side: release the event returned by d3h_event_ring_peek(). */
+static inline void
+d3h_event_ring_advance(d3h_event_ring_t *ring)
+{
+    __atomic_store_n(&ring->readIndex, ring->readIndex + 1, __ATOMIC_RELEASE);
+}
+
+/* Either side: the count of dropped events, for reporting. */
+static inline unsigned long
+d3h_event_ring_dropped(d3h_event_ring_t *ring)
+{
+    return __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+}
+
+#endif /* _EVENT_RING_H */
@@ -0,0 +1,46 @@
+/* -*- c-basic-offset: 4 -*-  vi:set ts=8 sts=4 sw=4: */
+
+/* gui_process.h
+ *
+ * DSSI Soft Synth Interface
+ *
+ * Keeping track of a GUI process started by jack-dssi-host.  Each
+ * instance remembers the pid of the GUI it started, so as not to
+ * start a second while that one is running, and reaps it once it has
+ * exited, so that it doesn't linger as a zombie.
+ */
+
+/*
+ * Copyright 2004, 2009 Chris Cannam, Steve Harris and Sean Bolton.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software
+ * for any purpose is hereby granted without fee, provided that the
+ * above copyright notice and this permission notice are included in
+ * all copies or substantial portions of the software.
+ */
+
+#ifndef _GUI_PROCESS_H
+#define _GUI_PROCESS_H
+
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <errno.h>
+
+/* Reaps the GUI process *pid, without waiting, if it has exited (or
+ * is not our child at all), and sets *pid to 0.  Returns 0 if it is
+ * still running, else 1, as it also does if *pid is already 0. */
+static inline int
+d3h_gui_reap(pid_t *pid)
+{
+    pid_t r;
+
+    if (!*pid) return 1;
+
+    while ((r = waitpid(*pid, NULL, WNOHANG)) < 0 && errno == EINTR);
+    if (r == 0) return 0;
+
+    *pid = 0;
+    return 1;
+}
+
+#endif /* _GUI_PROCESS_H */
@@ -4,15 +4,17 @@
  *
  * DSSI Soft Synth Interface
  *
- * This is a host for DSSI plugins.  It listens for MIDI events on an
- * ALSA sequencer port, delivers them to DSSI synths and outputs the
- * result via JACK.
+ * This is a host for DSSI plugins.  It listens for MIDI events on
+ * ALSA sequencer ports (or JACK MIDI ports), delivers them to DSSI
+ * synths and outputs the result via JACK.
  *
- * This program expects the names of up to 16 DSSI synth plugins, in
- * the form '<dll-name>:<label>',* to be provided on the command line.
- * If just '<dll-name>' is provided, the first plugin in the DLL is
- * is used.  MIDI channels are assigned to each plugin instance, in
- * order, beginning with channel 0 (zero-based).  A plugin may be
+ * This program expects the names of DSSI synth plugins, in the form
+ * '<dll-name>:<label>',* to be provided on the command line.  If just
+ * '<dll-name>' is provided, the first plugin in the DLL is is used.
+ * MIDI channels are assigned to each plugin instance, in order,
+ * beginning with channel 0 (zero-based) of the first MIDI port and
+ * going on to the next port after channel 15, unless a port and
+ * channel are given with '-r <port>:<channel>'.  A plugin may be
  * easily instantiated multiple times by preceding its name and label
  * with a dash followed immediately by the desired number of instances,
  * e.g. '-3 my_plugins.so:zoomy' would create three instances of the
@@ -41,6 +43,7 @@
 #include <alsa/asoundlib.h>
 #include <alsa/seq.h>
 #include <jack/jack.h>
+#include <jack/midiport.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -56,10 +59,31 @@
 #include <dirent.h>
 #include <time.h>
 #include <libgen.h>
+#include <spawn.h>
+#include <arpa/inet.h>
 
 #include <lo/lo.h>
+#include <pthread.h>
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H) && \
+    defined(HAVE_SYS_SIGNALFD_H) && defined(HAVE_LO_SERVER_GET_SOCKET_FD)
+/* the main loop can sleep until there's something to do */
+#define D3H_EPOLL 1
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#endif
 
 #include "jack-dssi-host.h"
+#include "event_ring.h"
+#include "worker_pool.h"
+#include "plugin_index.h"
+#include "midi_file.h"
+#include "gui_process.h"
+
+#ifdef HAVE_SNDFILE
+#include <sndfile.h>
+#endif
 
 #include "../message_buffer/message_buffer.h"
 
@@ -69,6 +93,20 @@ static snd_seq_t *alsaClient;
 
 static jack_client_t *jackClient;
 static jack_port_t **inputPorts, **outputPorts;
+static int outputPortCount;  /* outsTotal, or two per bus in bus mode */
+static jack_port_t **midiInputPorts = NULL;     /* if taking MIDI from JACK rather than ALSA */
+static unsigned long jackMidiEventsDropped = 0; /* written only by the audio thread */
+static snd_seq_event_t **jackEventBuffers;      /* this cycle's JACK MIDI events, by instance */
+static unsigned long *jackEventCounts;
+
+/* Written only by the audio thread, and reported from the main loop */
+static unsigned long *eventsShed;     /* by instance: dropped to make room for more important events */
+static unsigned long *eventsDeferred; /* by instance: held over to the next cycle */
+
+static int midiPortCount = 0;
+#ifdef MIDI_ALSA
+static int *alsaPortIds;              /* ALSA sequencer port id of each MIDI port */
+#endif
 
 static d3h_dll_t     *dlls;
 
@@ -77,45 +115,205 @@ static int            plugin_count = 0;
 
 static float sample_rate;
 
-static d3h_instance_t instances[D3H_MAX_INSTANCES];
+static d3h_instance_t *instances;
 static int            instance_count = 0;
 
 static LADSPA_Handle    *instanceHandles;
 static snd_seq_event_t **instanceEventBuffers;
 static unsigned long    *instanceEventCounts;
 
+static d3h_run_unit_t *runUnits;
+static int            runUnitCount = 0;
+static jack_nframes_t runFrames;      /* frames to run in this cycle */
+static d3h_pool_t    *workerPool = NULL;
+
+static int  *setupJobStarts;   /* by setup job, its first entry in setupOrder, plus one past the end */
+static int  *setupOrder;       /* instance numbers, grouped by setup job */
+static int   setupFailed = 0;
+
 static int insTotal, outsTotal;
 static float **pluginInputBuffers, **pluginOutputBuffers;
+static float **jackInputBuffers, **jackOutputBuffers;  /* this cycle's JACK port buffers */
+static float **runOutputBuffers;                       /* where each plugin output goes, in bus mode */
+
+/* In pipelined mode the workers render one period into one set of
+ * buffers while the JACK thread hands out the other set, rendered
+ * during the previous period.  The plain pointers above and the
+ * instance event buffers always refer to the set being filled. */
+#define D3H_BUFFER_SETS 2
+static float           **pluginInputBufferSets[D3H_BUFFER_SETS];
+static float           **pluginOutputBufferSets[D3H_BUFFER_SETS];
+static snd_seq_event_t **instanceEventBufferSets[D3H_BUFFER_SETS];
+static unsigned long    *instanceEventCountSets[D3H_BUFFER_SETS];
+static snd_seq_event_t **instanceControlBufferSets[D3H_BUFFER_SETS];
+static unsigned long    *instanceControlCountSets[D3H_BUFFER_SETS];
+static int               bufferSet = 0;
+
+/* Program changes after the start of a cycle (and, with splitFrames
+ * set, control changes) are held here, by instance, until run_unit()
+ * reaches them */
+static snd_seq_event_t **instanceControlBuffers;
+static unsigned long    *instanceControlCounts;
+static float           **connectedInputBuffers, **connectedOutputBuffers;
+static snd_seq_event_t **splitEventBuffers;  /* by instance: the events for the current sub-block */
+static unsigned long    *splitEventCounts;
+static unsigned long    *splitEventIndex;    /* by instance: the first event not yet run */
+static unsigned long    *splitControlIndex;  /* by instance: the first control change not yet applied */
 
 static int controlInsTotal, controlOutsTotal;
 static float *pluginControlIns, *pluginControlOuts;
-static d3h_instance_t *channel2instance[D3H_MAX_CHANNELS]; /* maps MIDI channel to instance */
+static d3h_instance_t **channel2instance;                  /* maps MIDI port * D3H_MAX_CHANNELS + channel to instance */
 static d3h_instance_t **pluginControlInInstances;          /* maps global control in # to instance */
 static unsigned long *pluginControlInPortNumbers;          /* maps global control in # to instance LADSPA port # */
-static int *pluginPortUpdated;                             /* indexed by global control in # */
+static int *pluginPortUpdated;                             /* by global control in #: a change is queued for the UI */
+static int *pluginControlInControllers;                     /* by global control in #: the plugin's get_midi_controller_for_port() */
+static float **controllerValueTables;                      /* by global control in #: port value for each MIDI controller value, if mapped */
+static float **fineValueTables;                            /* the same for 14-bit values, if mapped to an NRPN or 14-bit controller */
 
 static char osc_path_tmp[1024];
 
+/* The methods an instance answers to */
+enum {
+    D3H_OSC_CONFIGURE,
+    D3H_OSC_CONTROL,
+    D3H_OSC_MIDI,
+    D3H_OSC_PROGRAM,
+    D3H_OSC_UPDATE,
+    D3H_OSC_EXITING,
+    D3H_OSC_SHOW,
+    D3H_OSC_METHOD_COUNT
+};
+static const char *oscMethodNames[D3H_OSC_METHOD_COUNT] = {
+    "configure", "control", "midi", "program", "update", "exiting", "show"
+};
+static d3h_osc_route_t *oscRoutes;       /* by hash of the full path */
+static unsigned long    oscRouteMask;    /* table size - 1 */
+
+#define D3H_HASH_SEED 2166136261UL
+
 static char *projectDirectory;
+static char *oscUrl;          /* ours, ending in /dssi */
 
+#ifdef D3H_EPOLL
+static lo_server oscServer;   /* read by the main loop */
+#else
 lo_server_thread serverThread;
+#endif
+
+/* Set when the threads running the instances leave the main loop
+ * something to pass on or report.  The audio thread wakes the main
+ * loop once a cycle if so, rather than the main loop waking to look. */
+static int mainLoopNews = 0;
+
+#ifdef D3H_EPOLL
+static int mainLoopWakeFd = -1;   /* an eventfd */
+
+/* what the main loop waits for */
+enum {
+    D3H_WAIT_ALSA,
+    D3H_WAIT_OSC,
+    D3H_WAIT_AUDIO,
+    D3H_WAIT_SIGNAL
+};
+#define D3H_WAIT_EVENTS 8
+#endif
+
+/* What we have to tell the UIs is noted with ui_note_*() and sent by
+ * the main loop in OSC bundles, keeping only the latest value of each
+ * port, program and configure key, and holding each UI to at most
+ * UI_MAX_MESSAGES messages and UI_MAX_BYTES bytes a second.  The
+ * sender state is guarded by uiSendMutex, as without D3H_EPOLL the
+ * OSC handlers run in the liblo server thread. */
+#define UI_BUNDLE_BYTES     1400    /* fits an ethernet MTU */
+#define UI_MAX_MESSAGES     1000    /* per second, per UI */
+#define UI_MAX_BYTES        131072  /* per second, per UI */
+#define UI_BURST_MS         100     /* allowance a quiet UI can save up */
+#define UI_BURST_MESSAGES   (UI_MAX_MESSAGES * UI_BURST_MS / 1000.0)
+#define UI_BURST_BYTES      (UI_MAX_BYTES * UI_BURST_MS / 1000.0)
+#define UI_SEND_INTERVAL_MS 10
+static pthread_mutex_t uiSendMutex = PTHREAD_MUTEX_INITIALIZER;
+static int uiSendPending = 0;     /* something is waiting to be sent */
+static char *uiControlDirty;      /* by global control in #: in its instance's uiDirtyControls */
+static float *uiControlValues;    /* by global control in #: the value to send */
 
 static sigset_t _signals;
 
+extern char **environ;
+
 int exiting = 0;
+static int guisExited = 0;   /* a child has exited, maybe a GUI, since we last looked */
 static int verbose = 0;
 static int autoconnect = 1;
 static int load_guis = 1;
+static int midi_delay = 0;   /* schedule MIDI one extra period late, for constant latency */
+static int jack_midi = 0;    /* take MIDI from a JACK MIDI port instead of ALSA */
+static int worker_threads = 0;
+static int pipelined = 0;    /* render one period ahead on the worker threads */
+static int busCount = 0;     /* mix instances into this many stereo busses, if nonzero */
+static jack_nframes_t splitFrames = 0;  /* if nonzero, split runs at control changes, into blocks of at least this many frames */
 const char *myName = NULL;
 
-#define EVENT_BUFFER_SIZE 1024
-static snd_seq_event_t midiEventBuffer[EVENT_BUFFER_SIZE]; /* ring buffer */
-static int midiEventReadIndex = 0, midiEventWriteIndex = 0;
+#define EVENT_BUFFER_SIZE 1024  /* must be 2^n */
+
+#define D3H_MAX_FRAMES 65536    /* most frames an option may ask for */
+
+#define D3H_RENDER_TAIL 2.0     /* seconds rendered after the last MIDI event */
+#define D3H_MIN_RENDER_RATE 8000
+#define D3H_MAX_RENDER_RATE 768000
 
-static pthread_mutex_t midiEventBufferMutex = PTHREAD_MUTEX_INITIALIZER;
+/* Once an instance's ring or event buffer is this full, only events
+ * that aren't sheddable are accepted */
+#define EVENT_HIGH_WATER (EVENT_BUFFER_SIZE * 3 / 4)
+
+#define FINE_VALUE_COUNT 16384  /* values of an NRPN or 14-bit controller */
+
+/* Each thread that produces MIDI events sorts them by instance as it
+ * receives them, writing them to a ring of its own for each instance,
+ * and the audio thread merges each instance's rings by timestamp. */
+enum {
+    D3H_PRODUCER_ALSA,      /* midi_callback(), in the main thread */
+    D3H_PRODUCER_OSC,       /* the OSC handlers, in the OSC thread or main loop */
+    D3H_PRODUCER_COUNT
+};
+static snd_seq_event_t  *midiEventBuffers[D3H_PRODUCER_COUNT];  /* EVENT_BUFFER_SIZE per instance */
+static d3h_event_ring_t *midiEventRings[D3H_PRODUCER_COUNT];    /* indexed by instance */
+
+/* Control and program changes made by whichever thread runs an
+ * instance, for the main thread to pass on to the UI, by instance */
+static snd_seq_event_t  *uiChangeBuffers;
+static d3h_event_ring_t *uiChangeRings;
+
+/* A controller event the producer has already mapped to a control
+ * port: data.raw32.d[0] holds the global control in number, and
+ * d[1] the bits of the float value for the port. */
+#define D3H_EVENT_CONTROL SND_SEQ_EVENT_USR0
+
+/* A program change held until its frame: data.raw32.d[0] holds the
+ * bank select MSB and d[1] the LSB that preceded it (or -1 if none),
+ * and d[2] the program. */
+#define D3H_EVENT_PROGRAM SND_SEQ_EVENT_USR1
+
+/* The same, but requested by the UI over OSC, so not to be reported
+ * back to it */
+#define D3H_EVENT_UI_CONTROL SND_SEQ_EVENT_USR2
+#define D3H_EVENT_UI_PROGRAM SND_SEQ_EVENT_USR3
+
+#define D3H_IS_CONTROL_EVENT(ev) \
+    ((ev)->type == D3H_EVENT_CONTROL || (ev)->type == D3H_EVENT_UI_CONTROL)
 
 LADSPA_Data get_port_default(const LADSPA_Descriptor *plugin, int port);
 
+static d3h_instance_t *classify_event(int producer, int port, snd_seq_event_t *ev);
+static void queue_event(int producer, d3h_instance_t *instance, snd_seq_event_t *ev);
+
+static void build_osc_routes(void);
+static unsigned long long osc_source_key(lo_address source);
+static int from_other_source(d3h_instance_t *instance, lo_address source);
+static void ui_note_control(d3h_instance_t *instance, int in, float value);
+static void ui_note_program(d3h_instance_t *instance, long bank, long program);
+static void ui_note_configure(d3h_instance_t *instance, const char *key, const char *value);
+static void ui_forget(d3h_instance_t *instance);
+static int ui_send(long long now);
 void osc_error(int num, const char *m, const char *path);
 
 int osc_message_handler(const char *path, const char *types, lo_arg **argv, int
@@ -131,38 +329,64 @@ signalHandler(int sig)
     exiting = 1;
 }
 
+static void
+childHandler(int sig)
+{
+    guisExited = 1;
+}
+
+static void
+note_main_loop_news(void)
+{
+    __atomic_store_n(&mainLoopNews, 1, __ATOMIC_RELEASE);
+}
+
+/* Called by the audio thread */
+static void
+wake_main_loop(void)
+{
+#ifdef D3H_EPOLL
+    uint64_t one = 1;
+
+    if (__atomic_exchange_n(&mainLoopNews, 0, __ATOMIC_ACQ_REL) &&
+	write(mainLoopWakeFd, &one, sizeof(one)) < 0) {
+	/* the counter is full, so the main loop has yet to wake anyway */
+    }
+#endif
+}
+
+static void
+stamp_event(snd_seq_event_t *ev)
+{
+    /* Change the event timestamp so that its tick field contains the
+       JACK frame time at which it was received and processed
+       (i.e. now).  Then in the audio callback we use that to
+       calculate frame offset. */
+
+    ev->time.tick = jack_frame_time(jackClient);
+}
+
 void
 midi_callback()
 {
+#ifdef MIDI_ALSA
     snd_seq_event_t *ev = 0;
-    struct timeval tv;
-
-    pthread_mutex_lock(&midiEventBufferMutex);
+    snd_seq_event_t stamped;
+    d3h_instance_t *instance;
+    int port;
 
-#ifdef MIDI_ALSA
     do {
 	if (snd_seq_event_input(alsaClient, &ev) > 0) {
 
-	    if (midiEventReadIndex == midiEventWriteIndex + 1) {
-		fprintf(stderr, "%s: Warning: MIDI event buffer overflow! ignoring incoming event\n", myName);
-		continue;
+	    for (port = 0; port < midiPortCount; port++) {
+		if (alsaPortIds[port] == ev->dest.port) break;
 	    }
 
-	    midiEventBuffer[midiEventWriteIndex] = *ev;
+	    stamped = *ev;
+	    stamp_event(&stamped);
 
-	    ev = &midiEventBuffer[midiEventWriteIndex];
-
-	    /* At this point we change the event timestamp so that its
-	       real-time field contains the actual time at which it was
-	       received and processed (i.e. now).  Then in the audio
-	       callback we use that to calculate frame offset. */
-
-	    gettimeofday(&tv, NULL);
-	    ev->time.time.tv_sec = tv.tv_sec;
-	    ev->time.time.tv_nsec = tv.tv_usec * 1000L;
-
-	    if (ev->type == SND_SEQ_EVENT_NOTEON && ev->data.note.velocity == 0) {
-		ev->type =  SND_SEQ_EVENT_NOTEOFF;
+	    if (stamped.type == SND_SEQ_EVENT_NOTEON && stamped.data.note.velocity == 0) {
+		stamped.type =  SND_SEQ_EVENT_NOTEOFF;
 	    }
 
 	    /* We don't need to handle EVENT_NOTE here, because ALSA
@@ -171,17 +395,47 @@ midi_callback()
 	       dispatched.  We would only need worry about them when
 	       retrieving MIDI events from some other source. */
 
-	    midiEventWriteIndex = (midiEventWriteIndex + 1) % EVENT_BUFFER_SIZE;
+	    /* overflow is counted by the ring and reported from the
+	       main loop */
+	    if (port < midiPortCount &&
+		(instance = classify_event(D3H_PRODUCER_ALSA, port, &stamped))) {
+		queue_event(D3H_PRODUCER_ALSA, instance, &stamped);
+	    }
 	}
 	
     } while (snd_seq_event_input_pending(alsaClient, 0) > 0);
 #endif
+}
+
+/* Frame times wrap, so compare them by signed difference */
+#define FRAME_TIME_DIFF(a, b) ((int32_t)((jack_nframes_t)(a) - (jack_nframes_t)(b)))
 
-    pthread_mutex_unlock(&midiEventBufferMutex);
+/* Returns the oldest event waiting for an instance in any producer's
+ * ring, setting *ring to the ring it came from, or NULL if all its
+ * rings are empty. */
+static snd_seq_event_t *
+next_midi_event(int instance, d3h_event_ring_t **ring)
+{
+    snd_seq_event_t *ev = NULL, *head;
+    int p;
+
+    for (p = 0; p < D3H_PRODUCER_COUNT; p++) {
+	head = d3h_event_ring_peek(&midiEventRings[p][instance]);
+	if (head &&
+	    (!ev || FRAME_TIME_DIFF(head->time.tick, ev->time.tick) < 0)) {
+	    ev = head;
+	    *ring = &midiEventRings[p][instance];
+	}
+    }
+    return ev;
 }
 
-void
-setControl(d3h_instance_t *instance, long controlIn, snd_seq_event_t *event)
+/* Fills in the table of port values for a control in, indexed by
+ * controller value from 0 to size - 1.  Returns 0, leaving the table
+ * alone, if the port's range gives us no way to map a controller onto
+ * it. */
+static int
+fill_control_table(d3h_instance_t *instance, long controlIn, float *table, int size)
 {
     long port = pluginControlInPortNumbers[controlIn];
 
@@ -197,18 +451,22 @@ setControl(d3h_instance_t *instance, long controlIn, snd_seq_event_t *event)
 	(LADSPA_IS_HINT_SAMPLE_RATE(p->PortRangeHints[port].HintDescriptor) ?
 	 sample_rate : 1.0f);
 
-    float value = (float)event->data.control.value;
+    int i;
+
+    if (!LADSPA_IS_HINT_BOUNDED_BELOW(d) && !LADSPA_IS_HINT_BOUNDED_ABOVE(d)) {
+	/* unbounded: might as well leave the value alone. */
+	return 0;
+    }
 
-    if (!LADSPA_IS_HINT_BOUNDED_BELOW(d)) {
-	if (!LADSPA_IS_HINT_BOUNDED_ABOVE(d)) {
-	    /* unbounded: might as well leave the value alone. */
-            return;
-	} else {
+    for (i = 0; i < size; i++) {
+
+	/* in the units of a 7-bit controller */
+	float value = (float)i * 127.0f / (float)(size - 1);
+
+	if (!LADSPA_IS_HINT_BOUNDED_BELOW(d)) {
 	    /* bounded above only. just shift the range. */
 	    value = ub - 127.0f + value;
-	}
-    } else {
-	if (!LADSPA_IS_HINT_BOUNDED_ABOVE(d)) {
+	} else if (!LADSPA_IS_HINT_BOUNDED_ABOVE(d)) {
 	    /* bounded below only. just shift the range. */
 	    value = lb + value;
 	} else {
@@ -222,304 +480,1204 @@ setControl(d3h_instance_t *instance, long controlIn, snd_seq_event_t *event)
 		value = lb + ((ub - lb) * value / 127.0f);
 	    }
 	}
+	if (LADSPA_IS_HINT_INTEGER(d)) {
+	    value = lrintf(value);
+	}
+
+	table[i] = value;
+    }
+    return 1;
+}
+
+/* Keeps a control in's table of a given size up to date, if wanted */
+static void
+update_control_table(d3h_instance_t *instance, long controlIn, float **table,
+		     int size, int wanted)
+{
+    if (!wanted) return;
+
+    if (!*table) {
+	*table = (float *)malloc(size * sizeof(float));
+    }
+    if (!fill_control_table(instance, controlIn, *table, size)) {
+	free(*table);
+	*table = NULL;
+    }
+}
+
+/* (Re)builds the controller value tables for a plugin's control ins.
+ * Port ranges are the same for every instance of a plugin, so the
+ * instances share their tables, built for each control in that any
+ * of them maps a controller to.  Called at startup and when the
+ * sample rate changes, which can move the range of a port; tables are
+ * only allocated the first time. */
+static void
+build_controller_tables(d3h_plugin_t *plugin)
+{
+    d3h_instance_t *first = NULL;
+    int i, k, coarse, fine, controller;
+    long controlIn;
+
+    for (k = 0; k < plugin->controlIns; k++) {
+
+	coarse = fine = 0;
+	for (i = 0; i < instance_count; i++) {
+	    if (instances[i].plugin != plugin) continue;
+	    if (!first) first = &instances[i];
+	    controller = pluginControlInControllers[instances[i].firstControlIn + k];
+	    if (!DSSI_CONTROLLER_IS_SET(controller)) continue;
+	    if (DSSI_IS_CC(controller)) {
+		coarse = 1;
+		if (DSSI_CC_NUMBER(controller) < 32) fine = 1;
+	    }
+	    if (DSSI_IS_NRPN(controller)) fine = 1;
+	}
+	if (!first) return;
+
+	controlIn = first->firstControlIn + k;
+	update_control_table(first, controlIn, &controllerValueTables[controlIn],
+			     MIDI_CONTROLLER_COUNT, coarse);
+	update_control_table(first, controlIn, &fineValueTables[controlIn],
+			     FINE_VALUE_COUNT, fine);
+
+	for (i = first->number + 1; i < instance_count; i++) {
+	    if (instances[i].plugin != plugin) continue;
+	    controllerValueTables[instances[i].firstControlIn + k] =
+		controllerValueTables[controlIn];
+	    fineValueTables[instances[i].firstControlIn + k] =
+		fineValueTables[controlIn];
+	}
     }
-    if (LADSPA_IS_HINT_INTEGER(d)) {
-        value = lrintf(value);
+}
+
+/* Turns a controller event into a D3H_EVENT_CONTROL event carrying
+ * the port value at index value of the given table for the control
+ * in.  Returns 0 if the port's range gives us no way to map the
+ * controller onto it. */
+static int
+setControl(d3h_instance_t *instance, long controlIn, const float *table,
+	   unsigned int size, unsigned int value, snd_seq_event_t *event)
+{
+    float portValue;
+
+    if (!table) {
+	return 0;
     }
+    portValue = table[value < size ? value : size - 1];
 
     if (verbose) {
-	printf("%s: %s MIDI controller %d=%d -> control in %ld=%f\n", myName,
-	       instance->friendly_name, event->data.control.param,
-	       event->data.control.value, controlIn, value);
+	printf("%s: %s MIDI controller value %u/%u -> control in %ld=%f\n", myName,
+	       instance->friendly_name, value, size - 1, controlIn, portValue);
     }
 
-    pluginControlIns[controlIn] = value;
-    pluginPortUpdated[controlIn] = 1;
+    event->type = D3H_EVENT_CONTROL;
+    event->data.raw32.d[0] = controlIn;
+    memcpy(&event->data.raw32.d[1], &portValue, sizeof(float));
+    return 1;
 }
 
-int
-audio_callback(jack_nframes_t nframes, void *arg)
+/* Maps a controller event for an instance onto a control port, if
+ * the instance has mapped the controller, or the NRPN it sets, or it
+ * is the LSB of a mapped 14-bit controller.  Returns 0 if the event
+ * should be dropped.  The (N)RPN state machine runs on every
+ * controller event, so that data entry for an RPN, or an unmapped
+ * NRPN, goes to the plugin as it is. */
+static int
+map_controller(int producer, d3h_instance_t *instance, snd_seq_event_t *ev)
 {
-    int i;
-    int outCount, inCount;
-    d3h_instance_t *instance;
-    struct timeval tv, evtv, diff;
-    long framediff;
+    d3h_controller_state_t *state = &instance->controllerStates[producer];
+    int controller = ev->data.control.param;
+    unsigned int value = ev->data.control.value & 0x7f;
+    unsigned int fineValue;
+    long controlIn;
+
+    /* A lone MSB is extended as value << 7 | value, so that a 7-bit
+     * controller still covers the whole range, landing exactly on the
+     * 7-bit table's values. */
+
+    switch (controller) {
+    case 99: // NRPN MSB
+	state->nrpnMSB = value;
+	state->nrpnSelected = 1;
+	break;
+    case 98: // NRPN LSB
+	state->nrpnLSB = value;
+	state->nrpnSelected = 1;
+	break;
+    case 101: // RPN MSB
+    case 100: // RPN LSB
+	state->nrpnSelected = 0;
+	break;
+    case 6:  // data entry MSB
+    case 38: // data entry LSB
+	if (controller == 6) {
+	    state->dataMSB = value;
+	    fineValue = (value << 7) | value;
+	} else {
+	    fineValue = (state->dataMSB << 7) | value;
+	}
+	if (state->nrpnSelected && instance->nrpnMap &&
+	    (controlIn = instance->nrpnMap[(state->nrpnMSB << 7) |
+					   state->nrpnLSB]) >= 0) {
+	    return setControl(instance, controlIn, fineValueTables[controlIn],
+			      FINE_VALUE_COUNT, fineValue, ev);
+	}
+	break;
+    }
 
-    gettimeofday(&tv, NULL);
+    if (controller == 0 || controller == 32) {
+	/* bank select, for dispatch_event() */
+	return 1;
+    }
 
-    /* Not especially pretty or efficient */
+    if (controller < 32) {
+	state->ccMSB[controller] = value;
+    }
 
-    for (i = 0; i < instance_count; i++) {
-        instanceEventCounts[i] = 0;
+    controlIn = instance->controllerMap[controller];
+    if (controlIn >= 0) {
+	/* controller is mapped to LADSPA port, so will update the port */
+	return setControl(instance, controlIn, controllerValueTables[controlIn],
+			  MIDI_CONTROLLER_COUNT, value, ev);
     }
 
-    for ( ; midiEventReadIndex != midiEventWriteIndex;
-         midiEventReadIndex = (midiEventReadIndex + 1) % EVENT_BUFFER_SIZE) {
+    if (controller >= 32 && controller < 64 &&
+	(controlIn = instance->controllerMap[controller - 32]) >= 0) {
+	/* LSB of a mapped 14-bit controller */
+	fineValue = (state->ccMSB[controller - 32] << 7) | value;
+	return setControl(instance, controlIn, fineValueTables[controlIn],
+			  FINE_VALUE_COUNT, fineValue, ev);
+    }
 
-	snd_seq_event_t *ev = &midiEventBuffer[midiEventReadIndex];
+    return 1;
+}
 
-        if (!snd_seq_ev_is_channel_type(ev)) {
-            /* discard non-channel oriented messages */
-            continue;
-        }
+/* Decodes one complete MIDI channel message into an ALSA sequencer
+ * event, returning 0 if it isn't one we can deliver to a plugin. */
+static int
+decode_midi_event(const unsigned char *data, size_t size, snd_seq_event_t *ev)
+{
+    if (size < 2 || data[0] < 0x80 || data[0] >= 0xf0) {
+	return 0; /* not a channel message */
+    }
 
-        instance = channel2instance[ev->data.note.channel];
-        if (!instance
-	    /* || instance->inactive */) /* no -- see comment in osc_exiting_handler */
-	{
-            /* discard messages intended for channels we aren't using or
-	       absent or exited plugins */
-            continue;
-        }
-        i = instance->number;
-
-        /* Stop processing incoming MIDI if an instance's event buffer is
-         * full. */
-	if (instanceEventCounts[i] == EVENT_BUFFER_SIZE)
-            break;
-
-	/* Each event has a real-time timestamp indicating when it was
-	 * received (set by midi_callback).  We need to calculate the
-	 * difference between then and the start of the audio callback
-	 * (held in tv), and use that to assign a frame offset, to
-	 * avoid jitter.  We should stop processing when we reach any
-	 * event received after the start of the audio callback. */
-
-	evtv.tv_sec = ev->time.time.tv_sec;
-	evtv.tv_usec = ev->time.time.tv_nsec / 1000;
-
-	if (evtv.tv_sec > tv.tv_sec ||
-	    (evtv.tv_sec == tv.tv_sec &&
-	     evtv.tv_usec > tv.tv_usec)) {
-	    break;
-	}
+    memset(ev, 0, sizeof(snd_seq_event_t));
+
+    switch (data[0] & 0xf0) {
+    case 0x80:
+    case 0x90:
+    case 0xa0:
+	if (size < 3) return 0;
+	ev->type = ((data[0] & 0xf0) == 0x80 ? SND_SEQ_EVENT_NOTEOFF :
+		    (data[0] & 0xf0) == 0xa0 ? SND_SEQ_EVENT_KEYPRESS :
+		    data[2] == 0 ? SND_SEQ_EVENT_NOTEOFF : SND_SEQ_EVENT_NOTEON);
+	ev->data.note.channel = data[0] & 0x0f;
+	ev->data.note.note = data[1];
+	ev->data.note.velocity = data[2];
+	break;
+    case 0xb0:
+	if (size < 3) return 0;
+	ev->type = SND_SEQ_EVENT_CONTROLLER;
+	ev->data.control.channel = data[0] & 0x0f;
+	ev->data.control.param = data[1];
+	ev->data.control.value = data[2];
+	break;
+    case 0xc0:
+	ev->type = SND_SEQ_EVENT_PGMCHANGE;
+	ev->data.control.channel = data[0] & 0x0f;
+	ev->data.control.value = data[1];
+	break;
+    case 0xd0:
+	ev->type = SND_SEQ_EVENT_CHANPRESS;
+	ev->data.control.channel = data[0] & 0x0f;
+	ev->data.control.value = data[1];
+	break;
+    case 0xe0:
+	if (size < 3) return 0;
+	ev->type = SND_SEQ_EVENT_PITCHBEND;
+	ev->data.control.channel = data[0] & 0x0f;
+	ev->data.control.value = ((data[2] << 7) | data[1]) - 8192;
+	break;
+    }
+    return 1;
+}
 
-	diff.tv_sec = tv.tv_sec - evtv.tv_sec;
-	if (tv.tv_usec < evtv.tv_usec) {
-	    --diff.tv_sec;
-	    diff.tv_usec = tv.tv_usec + 1000000 - evtv.tv_usec;
-	} else {
-	    diff.tv_usec = tv.tv_usec - evtv.tv_usec;
+/* Fetches and decodes the next deliverable event from a JACK MIDI
+ * port buffer, with its frame offset in time.tick.  Returns 0 when
+ * there are none left. */
+static int
+next_jack_midi_event(void *buffer, uint32_t count, uint32_t *index,
+		     snd_seq_event_t *ev)
+{
+    jack_midi_event_t jev;
+
+    while (*index < count) {
+	if (jack_midi_event_get(&jev, buffer, (*index)++) == 0 &&
+	    decode_midi_event(jev.buffer, jev.size, ev)) {
+	    ev->time.tick = jev.time;
+	    return 1;
 	}
+    }
+    return 0;
+}
+
+/* Finds the instance an event received on a MIDI port is for,
+ * mapping it on the way if it is
+ * for a controller assigned to a control port.  Returns NULL if the
+ * event is of no interest to any instance.  This is called by each
+ * producer as it receives events, to keep the work out of the audio
+ * thread; apart from the producer's own controller state, it reads
+ * only what is fixed once the plugins are set up. */
+static d3h_instance_t *
+classify_event(int producer, int port, snd_seq_event_t *ev)
+{
+    d3h_instance_t *instance;
+    int controller;
 
-	framediff =
-	    diff.tv_sec * sample_rate +
-	    ((diff.tv_usec / 1000) * sample_rate) / 1000 +
-	    ((diff.tv_usec - 1000 * (diff.tv_usec / 1000)) * sample_rate) / 1000000;
+    if (!snd_seq_ev_is_channel_type(ev)) {
+	/* discard non-channel oriented messages */
+	return NULL;
+    }
 
-	if (framediff >= nframes) framediff = nframes - 1;
-	else if (framediff < 0) framediff = 0;
+    instance = channel2instance[port * D3H_MAX_CHANNELS + ev->data.note.channel];
+    if (!instance
+	/* || instance->inactive */) /* no -- see comment in osc_exiting_handler */
+    {
+	/* discard messages intended for channels we aren't using or
+	   absent or exited plugins */
+	return NULL;
+    }
 
-	ev->time.tick = nframes - framediff - 1;
+    if (ev->type == SND_SEQ_EVENT_CONTROLLER) {
 
-	if (ev->type == SND_SEQ_EVENT_CONTROLLER) {
-	    
-	    int controller = ev->data.control.param;
+	controller = ev->data.control.param;
 #ifdef DEBUG
-	    MB_MESSAGE("%s CC %d(0x%02x) = %d\n", instance->friendly_name,
-                       controller, controller, ev->data.control.value);
+	MB_MESSAGE("%s CC %d(0x%02x) = %d\n", instance->friendly_name,
+		   controller, controller, ev->data.control.value);
 #endif
 
-	    if (controller == 0) { // bank select MSB
+	if (controller >= MIDI_CONTROLLER_COUNT) {
+	    return NULL;
+	}
+	if (!map_controller(producer, instance, ev)) {
+	    return NULL;
+	}
+    }
 
-		instance->pendingBankMSB = ev->data.control.value;
+    return instance;
+}
 
-	    } else if (controller == 32) { // bank select LSB
+/* Returns nonzero for an event that can be lost under load with
+ * little harm, because a later event of the same kind will supersede
+ * it: continuous controllers, pressure, pitch bend and control changes
+ * from a UI.  Switch, parameter number and channel mode controllers
+ * are not sheddable, nor of course are notes and program changes. */
+static int
+is_sheddable(const snd_seq_event_t *ev)
+{
+    unsigned int param;
+
+    switch (ev->type) {
+    case D3H_EVENT_CONTROL:
+    case D3H_EVENT_UI_CONTROL:   /* a UI sends a stream of these while a control is dragged */
+    case SND_SEQ_EVENT_KEYPRESS:
+    case SND_SEQ_EVENT_CHANPRESS:
+    case SND_SEQ_EVENT_PITCHBEND:
+	return 1;
+    case SND_SEQ_EVENT_CONTROLLER:
+	param = ev->data.control.param;
+	return !(param == 0 || param == 32 ||          /* bank select */
+		 param == 6 || param == 38 ||          /* data entry */
+		 (param >= 64 && param <= 69) ||       /* switches */
+		 (param >= 96 && param <= 101) ||      /* (N)RPN */
+		 param >= 120);                        /* channel mode */
+    default:
+	return 0;
+    }
+}
 
-		instance->pendingBankLSB = ev->data.control.value;
+/* Queues a classified event for an instance.  Sheddable events are
+ * refused once the ring is past its high water mark, so that a flood
+ * of controllers can't crowd out notes.  Refused events are counted
+ * by the ring and reported from the main loop. */
+static void
+queue_event(int producer, d3h_instance_t *instance, snd_seq_event_t *ev)
+{
+    d3h_event_ring_write_reserved(&midiEventRings[producer][instance->number], ev,
+				  is_sheddable(ev) ?
+				  EVENT_BUFFER_SIZE - EVENT_HIGH_WATER : 0);
+}
 
-	    } else if (controller > 0 && controller < MIDI_CONTROLLER_COUNT) {
+/* Tells the main thread that a control in has changed, for the UI.
+ * A control in has at most one change queued at a time, and the main
+ * thread sends its value as of when it takes the change, so the UI
+ * gets the latest value without having to keep up with every one, and
+ * the ring (with room for all of an instance's control ins) can't
+ * overflow. */
+static void
+queue_ui_control(long controlIn)
+{
+    snd_seq_event_t ev;
 
-		long controlIn = instance->controllerMap[controller];
-		if (controlIn >= 0) {
+    if (__atomic_exchange_n(&pluginPortUpdated[controlIn], 1, __ATOMIC_SEQ_CST)) {
+	return;
+    }
+    ev.type = D3H_EVENT_CONTROL;
+    ev.data.raw32.d[0] = controlIn;
+    d3h_event_ring_write(&uiChangeRings[pluginControlInInstances[controlIn]->number], &ev);
+    note_main_loop_news();
+}
 
-                    /* controller is mapped to LADSPA port, update the port */
-		    setControl(instance, controlIn, ev);
+/* The same for an instance's current program */
+static void
+queue_ui_program(d3h_instance_t *instance)
+{
+    snd_seq_event_t ev;
 
-		} else {
+    if (__atomic_exchange_n(&instance->uiProgramQueued, 1, __ATOMIC_SEQ_CST)) {
+	return;
+    }
+    ev.type = D3H_EVENT_PROGRAM;
+    d3h_event_ring_write(&uiChangeRings[instance->number], &ev);
+    note_main_loop_news();
+}
 
-                    /* controller is not mapped, so pass the event through to plugin */
-                    instanceEventBuffers[i][instanceEventCounts[i]] = *ev;
-                    instanceEventCounts[i]++;
-                }
-	    }
+static void
+apply_control(const snd_seq_event_t *ev)
+{
+    long controlIn = ev->data.raw32.d[0];
 
-	} else if (ev->type == SND_SEQ_EVENT_PGMCHANGE) {
-	    
-	    instance->pendingProgramChange = ev->data.control.value;
-	    instance->uiNeedsProgramUpdate = 1;
+    memcpy(&pluginControlIns[controlIn], &ev->data.raw32.d[1], sizeof(float));
+    if (ev->type == D3H_EVENT_CONTROL) {
+	queue_ui_control(controlIn);
+    }
+}
 
+/* Selects a program, following a bank select MSB and/or LSB if not
+ * -1.  Called from the thread that runs the instance. */
+static void
+change_program(d3h_instance_t *instance, int msb, int lsb, int pc)
+{
+    //!!! gosh, I don't know this -- need to check with the specs:
+    // if you only send one of MSB/LSB controllers, should the
+    // other go to zero or remain as it was?  Assume it remains as
+    // it was, for now.
+
+    if (lsb >= 0) {
+	if (msb >= 0) {
+	    instance->currentBank = lsb + 128 * msb;
 	} else {
-
-            instanceEventBuffers[i][instanceEventCounts[i]] = *ev;
-            instanceEventCounts[i]++;
+	    instance->currentBank = lsb + 128 * (instance->currentBank / 128);
 	}
+    } else if (msb >= 0) {
+	instance->currentBank = (instance->currentBank % 128) + 128 * msb;
     }
 
-    /* process pending program changes */
-    for (i = 0; i < instance_count; i++) {
-        instance = &instances[i];
+    instance->currentProgram = pc;
 
-	/* no -- see comment in osc_exiting_handler */
-	/* if (instance->inactive) continue; */
+    if (instance->plugin->descriptor->select_program) {
+	instance->plugin->descriptor->
+	    select_program(instanceHandles[instance->number],
+			   instance->currentBank,
+			   instance->currentProgram);
+    }
+}
 
-        if (instance->pendingProgramChange >= 0) {
+/* Delivers one classified event, with its frame offset in time.tick,
+ * to an instance.  Returns -1, without taking the event, if the
+ * instance's event buffer is full.  Past the high water mark,
+ * sheddable events are taken but dropped. */
+static int
+dispatch_event(d3h_instance_t *instance, snd_seq_event_t *ev)
+{
+    int i = instance->number;
 
-            int pc = instance->pendingProgramChange;
-            int msb = instance->pendingBankMSB;
-            int lsb = instance->pendingBankLSB;
+    /* Stop processing incoming MIDI if an instance's event buffer is
+     * full. */
+    if (instanceEventCounts[i] == EVENT_BUFFER_SIZE)
+	return -1;
 
-            //!!! gosh, I don't know this -- need to check with the specs:
-            // if you only send one of MSB/LSB controllers, should the
-            // other go to zero or remain as it was?  Assume it remains as
-            // it was, for now.
+    if (D3H_IS_CONTROL_EVENT(ev)) {
 
-            if (lsb >= 0) {
-                if (msb >= 0) {
-                    instance->currentBank = lsb + 128 * msb;
-                } else {
-                    instance->currentBank = lsb + 128 * (instance->currentBank / 128);
-                }
-            } else if (msb >= 0) {
-                instance->currentBank = (instance->currentBank % 128) + 128 * msb;
-            }
+	if (splitFrames && ev->time.tick > 0) {
+	    if (instanceControlCounts[i] == EVENT_BUFFER_SIZE)
+		return -1;
+	    instanceControlBuffers[i][instanceControlCounts[i]++] = *ev;
+	} else {
+	    apply_control(ev);
+	}
 
-            instance->currentProgram = pc;
+    } else if (ev->type == SND_SEQ_EVENT_CONTROLLER &&
+	       ev->data.control.param == 0) { // bank select MSB
 
-            instance->pendingProgramChange = -1;
-            instance->pendingBankMSB = -1;
-            instance->pendingBankLSB = -1;
+	instance->pendingBankMSB = ev->data.control.value;
 
-            if (instance->plugin->descriptor->select_program) {
-                instance->plugin->descriptor->
-                    select_program(instanceHandles[instance->number],
-                                   instance->currentBank,
-                                   instance->currentProgram);
-            }
-        }
-    }
+    } else if (ev->type == SND_SEQ_EVENT_CONTROLLER &&
+	       ev->data.control.param == 32) { // bank select LSB
 
-    for (inCount = 0; inCount < insTotal; ++inCount) {
+	instance->pendingBankLSB = ev->data.control.value;
 
-	jack_default_audio_sample_t *buffer =
-	    jack_port_get_buffer(inputPorts[inCount], nframes);
-	
-	memcpy(pluginInputBuffers[inCount], buffer, nframes * sizeof(LADSPA_Data));
-    }
+    } else if (ev->type == SND_SEQ_EVENT_PGMCHANGE && ev->time.tick > 0) {
 
-    /* call run_synth() or run_multiple_synths() for all instances */
+	/* the plugin has to be run up to this frame first */
+	if (instanceControlCounts[i] == EVENT_BUFFER_SIZE)
+	    return -1;
+	ev->type = D3H_EVENT_PROGRAM;
+	ev->data.raw32.d[2] = ev->data.control.value;
+	ev->data.raw32.d[0] = instance->pendingBankMSB;
+	ev->data.raw32.d[1] = instance->pendingBankLSB;
+	instance->pendingBankMSB = -1;
+	instance->pendingBankLSB = -1;
+	instanceControlBuffers[i][instanceControlCounts[i]++] = *ev;
 
-    i = 0;
-    outCount = 0;
+    } else if (ev->type == SND_SEQ_EVENT_PGMCHANGE) {
 
-    while (i < instance_count) {
+	instance->pendingProgramChange = ev->data.control.value;
+	instance->uiNeedsProgramUpdate = 1;
 
-	/* no -- see comment in osc_exiting_handler */
-/*
-	if (instances[i].inactive) {
-	    int j;
-	    for (j = 0; j < instances[i].plugin->outs; ++j) {
-		memset(pluginOutputBuffers[outCount + j], 0, nframes * sizeof(LADSPA_Data));
-	    }
-	    outCount += j;
-	    ++i;
-	    continue;
-	}
-*/
-	outCount += instances[i].plugin->outs;
-
-        if (instances[i].plugin->descriptor->run_multiple_synths) {
-            instances[i].plugin->descriptor->run_multiple_synths
-                (instances[i].plugin->instances,
-                 instanceHandles + i,
-                 nframes,
-                 instanceEventBuffers + i,
-                 instanceEventCounts + i);
-            i += instances[i].plugin->instances;
-        } else if (instances[i].plugin->descriptor->run_synth) {
-            instances[i].plugin->descriptor->run_synth(instanceHandles[i],
-                                                       nframes,
-                                                       instanceEventBuffers[i],
-                                                       instanceEventCounts[i]);
-            i++;
-        } else if (instances[i].plugin->descriptor->LADSPA_Plugin->run) {
-	    instances[i].plugin->descriptor->LADSPA_Plugin->run(instanceHandles[i],
-								nframes);
-	    i++;
-	} else {
-	    fprintf(stderr, "DSSI plugin %d has no run_multiple_synths, run_synth or run method!\n", i);
-	    i++;
-	}
-    }
+    } else if (ev->type == D3H_EVENT_UI_PROGRAM && ev->time.tick > 0) {
 
-    assert(sizeof(LADSPA_Data) == sizeof(jack_default_audio_sample_t));
+	if (instanceControlCounts[i] == EVENT_BUFFER_SIZE)
+	    return -1;
+	instanceControlBuffers[i][instanceControlCounts[i]++] = *ev;
 
-    for (outCount = 0; outCount < outsTotal; ++outCount) {
+    } else if (ev->type == D3H_EVENT_UI_PROGRAM) {
 
-	jack_default_audio_sample_t *buffer =
-	    jack_port_get_buffer(outputPorts[outCount], nframes);
-	
-	memcpy(buffer, pluginOutputBuffers[outCount], nframes * sizeof(LADSPA_Data));
-    }
+	instance->pendingBankMSB = ev->data.raw32.d[0];
+	instance->pendingBankLSB = ev->data.raw32.d[1];
+	instance->pendingProgramChange = ev->data.raw32.d[2];
+	instance->uiNeedsProgramUpdate = 0;
+
+    } else if (instanceEventCounts[i] >= EVENT_HIGH_WATER && is_sheddable(ev)) {
+
+	++eventsShed[i];
+	note_main_loop_news();
 
+    } else {
+
+	/* including controllers not mapped to ports, which the
+	   plugin gets to see */
+	instanceEventBuffers[i][instanceEventCounts[i]] = *ev;
+	instanceEventCounts[i]++;
+    }
     return 0;
 }
 
-#ifndef RTLD_LOCAL
-#define RTLD_LOCAL  (0)
-#endif
-
-char *
-load(const char *dllName, void **dll, int quiet) /* returns directory where dll found */
+/* Runs frames frames of a run unit, with event buffers and counts
+ * taken from the given arrays, indexed by instance number */
+static void
+run_unit_frames(d3h_run_unit_t *unit, jack_nframes_t frames,
+		snd_seq_event_t **eventBuffers, unsigned long *eventCounts)
 {
-    static char *defaultDssiPath = 0;
-    const char *dssiPath = getenv("DSSI_PATH");
-    char *path, *origPath, *element, *message;
-    void *handle = 0;
-
-    /* If the dllName is an absolute path */
-    if (*dllName == '/') {
-	if ((handle = dlopen(dllName, RTLD_NOW |       /* real-time programs should not use RTLD_LAZY */
-                                      RTLD_LOCAL))) {  /* do not share symbols across plugins
-                                                        * (some systems (e.g. Mac OS X) default
-                                                        * to RTLD_GLOBAL!) */
-	    *dll = handle;
-            path = strdup(dllName);
-	    return dirname(path);
+    d3h_plugin_t *plugin = instances[unit->first].plugin;
+    int i = unit->first;
+
+    if (instances[i].runAdding) {
+	if (plugin->descriptor->run_multiple_synths_adding) {
+	    plugin->descriptor->run_multiple_synths_adding
+		(unit->count,
+		 instanceHandles + i,
+		 frames,
+		 eventBuffers + i,
+		 eventCounts + i);
+	} else if (plugin->descriptor->run_synth_adding) {
+	    plugin->descriptor->run_synth_adding(instanceHandles[i],
+						 frames,
+						 eventBuffers[i],
+						 eventCounts[i]);
 	} else {
-	    if (!quiet) {
-		fprintf(stderr, "Cannot find DSSI or LADSPA plugin at '%s'\n", dllName);
-	    }
-	    return NULL;
+	    plugin->descriptor->LADSPA_Plugin->run_adding(instanceHandles[i],
+							  frames);
 	}
+    } else if (plugin->descriptor->run_multiple_synths) {
+	plugin->descriptor->run_multiple_synths
+	    (unit->count,
+	     instanceHandles + i,
+	     frames,
+	     eventBuffers + i,
+	     eventCounts + i);
+    } else if (plugin->descriptor->run_synth) {
+	plugin->descriptor->run_synth(instanceHandles[i],
+				      frames,
+				      eventBuffers[i],
+				      eventCounts[i]);
+    } else if (plugin->descriptor->LADSPA_Plugin->run) {
+	plugin->descriptor->LADSPA_Plugin->run(instanceHandles[i],
+					       frames);
+    } else {
+	fprintf(stderr, "DSSI plugin %d has no run_multiple_synths, run_synth or run method!\n", i);
     }
+}
 
-    if (!dssiPath) {
-	if (!defaultDssiPath) {
-	    const char *home = getenv("HOME");
-	    if (home) {
-		defaultDssiPath = malloc(strlen(home) + 60);
-		sprintf(defaultDssiPath, "/usr/local/lib/dssi:/usr/lib/dssi:%s/.dssi", home);
-	    } else {
-		defaultDssiPath = strdup("/usr/local/lib/dssi:/usr/lib/dssi");
-	    }
-	}
-	dssiPath = defaultDssiPath;
-	if (!quiet) {
-	    fprintf(stderr, "\n%s: Warning: DSSI path not set\n%s: Defaulting to \"%s\"\n\n", myName, myName, dssiPath);
-	}
+/* Points an instance's audio ports at the given buffers, indexed by
+ * global audio in and out number, offset frames in */
+static void
+connect_instance_audio(int i, float **ins, float **outs, jack_nframes_t offset)
+{
+    d3h_instance_t *instance = &instances[i];
+    const LADSPA_Descriptor *ladspa = instance->plugin->descriptor->LADSPA_Plugin;
+    int j;
+
+    for (j = 0; j < instance->plugin->ins; j++) {
+	ladspa->connect_port(instanceHandles[i],
+			     instance->audioPortNumbers[j],
+			     ins[instance->firstIn + j] + offset);
     }
+    for (j = 0; j < instance->plugin->outs; j++) {
+	ladspa->connect_port(instanceHandles[i],
+			     instance->audioPortNumbers[instance->plugin->ins + j],
+			     outs[instance->firstOut + j] + offset);
+    }
+}
 
-    path = strdup(dssiPath);
-    origPath = path;
-    *dll = 0;
-
-    while ((element = strtok(path, ":")) != 0) {
+/* Runs a unit in sub-blocks, so that each program or control change
+ * held back by dispatch_event() takes effect at its own frame rather
+ * than at the start of the cycle, as select_program() requires.  A
+ * control change less than splitFrames after the start of a sub-block
+ * is brought forward to it, which bounds the number of sub-blocks and
+ * so the cost of splitting. */
+static void
+run_unit_split(d3h_run_unit_t *unit)
+{
+    int last = unit->first + unit->count;
+    jack_nframes_t start = 0, end;
+    snd_seq_event_t *ev;
+    unsigned long n;
+    int i, held = 0;
+
+    for (i = unit->first; i < last; i++) {
+	splitEventIndex[i] = 0;
+	splitControlIndex[i] = 0;
+	held += instanceControlCounts[i];
+    }
+    if (!held) {
+	run_unit_frames(unit, runFrames, instanceEventBuffers, instanceEventCounts);
+	return;
+    }
 
-	char *filePath;
+    while (start < runFrames) {
 
-	path = 0;
+	/* apply the changes due in this sub-block, and end it at the
+	   first one that isn't */
+
+	end = runFrames;
+	for (i = unit->first; i < last; i++) {
+	    ev = instanceControlBuffers[i];
+	    for (n = splitControlIndex[i]; n < instanceControlCounts[i]; n++) {
+		if (ev[n].time.tick > start &&
+		    (!D3H_IS_CONTROL_EVENT(&ev[n]) ||
+		     ev[n].time.tick >= start + splitFrames)) {
+		    break;
+		}
+		if (D3H_IS_CONTROL_EVENT(&ev[n])) {
+		    apply_control(&ev[n]);
+		} else {
+		    change_program(&instances[i], (int)ev[n].data.raw32.d[0],
+				   (int)ev[n].data.raw32.d[1],
+				   (int)ev[n].data.raw32.d[2]);
+		    if (ev[n].type == D3H_EVENT_PROGRAM) {
+			queue_ui_program(&instances[i]);
+		    }
+		}
+	    }
+	    splitControlIndex[i] = n;
+	    if (splitControlIndex[i] < instanceControlCounts[i] &&
+		ev[splitControlIndex[i]].time.tick < end) {
+		end = ev[splitControlIndex[i]].time.tick;
+	    }
+	}
+
+	/* hand each instance its events for the sub-block, with
+	   offsets from its start, and its audio from there on */
+
+	for (i = unit->first; i < last; i++) {
+	    ev = instanceEventBuffers[i];
+	    n = splitEventIndex[i];
+	    splitEventBuffers[i] = ev + n;
+	    while (n < instanceEventCounts[i] && ev[n].time.tick < end) {
+		ev[n].time.tick -= start;
+		++n;
+	    }
+	    splitEventCounts[i] = n - splitEventIndex[i];
+	    splitEventIndex[i] = n;
+	    connect_instance_audio(i, connectedInputBuffers, connectedOutputBuffers, start);
+	}
+
+	run_unit_frames(unit, end - start, splitEventBuffers, splitEventCounts);
+	start = end;
+    }
+}
+
+/* Runs one run unit: an instance, or a group of instances of a
+ * plugin with run_multiple_synths().  Units are independent of one
+ * another, so may be run concurrently. */
+static void
+run_unit(int u, void *arg)
+{
+    d3h_run_unit_t *unit = &runUnits[u];
+
+    /* no -- see comment in osc_exiting_handler */
+/*
+    if (instances[unit->first].inactive) {
+	int j;
+	for (j = 0; j < unit->outs; ++j) {
+	    memset(pluginOutputBuffers[unit->firstOut + j], 0, runFrames * sizeof(LADSPA_Data));
+	}
+	return;
+    }
+*/
+    run_unit_split(unit);
+}
+
+static void
+select_buffer_set(int set)
+{
+    bufferSet = set;
+    pluginInputBuffers = pluginInputBufferSets[set];
+    pluginOutputBuffers = pluginOutputBufferSets[set];
+    instanceEventBuffers = instanceEventBufferSets[set];
+    instanceEventCounts = instanceEventCountSets[set];
+    instanceControlBuffers = instanceControlBufferSets[set];
+    instanceControlCounts = instanceControlCountSets[set];
+}
+
+/* JACK will hand us the same buffer for an input and an output where
+ * it can, for example when our output is connected straight back to
+ * our input.  A plugin that can't process in place must not see that,
+ * so give it a copy of the input instead. */
+static void
+stage_aliased_inputs(jack_nframes_t nframes, float **outs)
+{
+    d3h_instance_t *instance;
+    int i, j, k;
+
+    for (i = 0; i < instance_count; i++) {
+	instance = &instances[i];
+	if (!LADSPA_IS_INPLACE_BROKEN(instance->plugin->descriptor->
+				      LADSPA_Plugin->Properties)) {
+	    continue;
+	}
+	for (j = instance->firstIn; j < instance->firstIn + instance->plugin->ins; j++) {
+	    for (k = instance->firstOut; k < instance->firstOut + instance->plugin->outs; k++) {
+		if (jackInputBuffers[j] == outs[k]) {
+		    memcpy(pluginInputBuffers[j], jackInputBuffers[j],
+			   nframes * sizeof(LADSPA_Data));
+		    jackInputBuffers[j] = pluginInputBuffers[j];
+		    break;
+		}
+	    }
+	}
+    }
+}
+
+static void
+mix_buffer(float *dest, const float *src, float gain, jack_nframes_t nframes)
+{
+    jack_nframes_t i;
+
+    /* kept simple enough for the compiler to vectorise */
+    for (i = 0; i < nframes; i++) {
+	dest[i] += gain * src[i];
+    }
+}
+
+/* Mixes the outputs of the instances that don't add into their bus
+ * themselves into the bus buffers in jackOutputBuffers.  A mono
+ * output goes to both sides of the bus; otherwise outputs alternate
+ * between left and right. */
+static void
+mix_into_busses(float **outs, jack_nframes_t nframes)
+{
+    d3h_instance_t *instance;
+    float *left, *right;
+    int i, j;
+
+    for (i = 0; i < instance_count; i++) {
+	instance = &instances[i];
+	if (instance->runAdding) continue;
+	left = jackOutputBuffers[2 * instance->bus];
+	right = jackOutputBuffers[2 * instance->bus + 1];
+	if (instance->plugin->outs == 1) {
+	    mix_buffer(left, outs[instance->firstOut], instance->gain, nframes);
+	    mix_buffer(right, outs[instance->firstOut], instance->gain, nframes);
+	    continue;
+	}
+	for (j = 0; j < instance->plugin->outs; j++) {
+	    mix_buffer(j % 2 ? right : left, outs[instance->firstOut + j],
+		       instance->gain, nframes);
+	}
+    }
+}
+
+/* Points every instance's audio ports at the given buffers, indexed
+ * by global audio in and out number */
+static void
+connect_audio_buffers(float **ins, float **outs)
+{
+    int i;
+
+    connectedInputBuffers = ins;
+    connectedOutputBuffers = outs;
+    for (i = 0; i < instance_count; i++) {
+	connect_instance_audio(i, ins, outs, 0);
+    }
+}
+
+/* Merges each instance's events for this cycle -- those collected in
+ * jackEventBuffers, which already have their frame offsets, and those
+ * waiting in its producer rings, timed from windowStart -- and hands
+ * them to it, then makes any pending program changes */
+static void
+deliver_events(jack_nframes_t nframes, jack_nframes_t windowStart)
+{
+    int i, p;
+    d3h_instance_t *instance;
+    d3h_event_ring_t *ring = NULL;
+    snd_seq_event_t *ev;
+    unsigned long k;
+    int32_t offset = 0;
+    unsigned int stamp;
+
+    /* For each instance, merge its JACK MIDI events with the events
+     * waiting in its producer rings */
+
+    for (i = 0; i < instance_count; i++) {
+	instance = &instances[i];
+        instanceEventCounts[i] = 0;
+	instanceControlCounts[i] = 0;
+	k = 0;
+
+	for (;;) {
+
+	    /* Each ring event has a JACK frame time stamp indicating
+	     * when it was received (set by stamp_event).  Its offset
+	     * from the start of the delivery window is its frame offset
+	     * in this cycle.  We should stop taking ring events when we
+	     * reach any received after the end of the window; as the
+	     * rings are merged oldest first, all remaining ones were
+	     * received later still.  Events older than the window
+	     * (after an xrun, or if the MIDI thread was held up) go at
+	     * the start of the cycle. */
+
+	    ev = next_midi_event(i, &ring);
+	    if (ev) {
+		offset = FRAME_TIME_DIFF(ev->time.tick, windowStart);
+		if (offset >= (int32_t)nframes) {
+		    ev = NULL;
+		} else if (offset < 0) {
+		    offset = 0;
+		}
+	    }
+
+	    if (k < jackEventCounts[i] &&
+		(!ev || (int32_t)jackEventBuffers[i][k].time.tick <= offset)) {
+
+		if (dispatch_event(instance, &jackEventBuffers[i][k]) < 0) {
+		    break;
+		}
+		++k;
+
+	    } else if (ev) {
+
+		stamp = ev->time.tick;
+		ev->time.tick = offset;
+		if (dispatch_event(instance, ev) < 0) {
+		    /* leave it and the rest in the rings until next
+		       cycle, without holding up other instances; it
+		       must keep its frame time stamp to be placed then */
+		    ev->time.tick = stamp;
+		    for (p = 0; p < D3H_PRODUCER_COUNT; p++) {
+			eventsDeferred[i] +=
+			    d3h_event_ring_read_space(&midiEventRings[p][i]);
+		    }
+		    note_main_loop_news();
+		    break;
+		}
+		d3h_event_ring_advance(ring);
+
+	    } else {
+		break;
+	    }
+	}
+
+	/* JACK MIDI can't wait for the next cycle, so anything we
+	 * couldn't deliver from the JACK port is lost */
+	if (k < jackEventCounts[i]) {
+	    jackMidiEventsDropped += jackEventCounts[i] - k;
+	    note_main_loop_news();
+	}
+	jackEventCounts[i] = 0;
+    }
+
+    /* process pending program changes */
+    for (i = 0; i < instance_count; i++) {
+        instance = &instances[i];
+
+	/* no -- see comment in osc_exiting_handler */
+	/* if (instance->inactive) continue; */
+
+        if (instance->pendingProgramChange >= 0) {
+
+            change_program(instance, instance->pendingBankMSB,
+                           instance->pendingBankLSB,
+                           instance->pendingProgramChange);
+
+            instance->pendingProgramChange = -1;
+            instance->pendingBankMSB = -1;
+            instance->pendingBankLSB = -1;
+
+            /* unless it came from the UI */
+            if (instance->uiNeedsProgramUpdate) {
+                instance->uiNeedsProgramUpdate = 0;
+                queue_ui_program(instance);
+            }
+        }
+    }
+}
+
+/* Runs every instance for a cycle on the audio buffers in
+ * jackInputBuffers and jackOutputBuffers */
+static void
+run_cycle(jack_nframes_t nframes)
+{
+    int i, j, outCount;
+    float **outputBuffers;
+    d3h_instance_t *instance;
+
+    if (busCount) {
+
+	/* Plugins that can add into their bus go straight there; the
+	 * rest render into our own buffers to be mixed in afterwards */
+
+	for (outCount = 0; outCount < outputPortCount; ++outCount) {
+	    memset(jackOutputBuffers[outCount], 0, nframes * sizeof(LADSPA_Data));
+	}
+	for (i = 0; i < instance_count; i++) {
+	    instance = &instances[i];
+	    for (j = 0; j < instance->plugin->outs; j++) {
+		runOutputBuffers[instance->firstOut + j] = instance->runAdding ?
+		    jackOutputBuffers[2 * instance->bus + j] :
+		    pluginOutputBuffers[instance->firstOut + j];
+	    }
+	}
+	outputBuffers = runOutputBuffers;
+
+    } else {
+	outputBuffers = jackOutputBuffers;
+    }
+
+    stage_aliased_inputs(nframes, outputBuffers);
+    connect_audio_buffers(jackInputBuffers, outputBuffers);
+
+    /* call run_synth() or run_multiple_synths() for all instances,
+     * spread across the worker threads if we have any */
+
+    runFrames = nframes;
+    if (workerPool) {
+	d3h_pool_run(workerPool, runUnitCount);
+    } else {
+	for (i = 0; i < runUnitCount; i++) {
+	    run_unit(i, NULL);
+	}
+    }
+
+    if (busCount) {
+	mix_into_busses(pluginOutputBuffers, nframes);
+    }
+}
+
+int
+audio_callback(jack_nframes_t nframes, void *arg)
+{
+    int i, p;
+    int outCount, inCount;
+    float **outputBuffers = pluginOutputBuffers;
+    d3h_instance_t *instance;
+    snd_seq_event_t jackEvent;
+    void *midiInputBuffer;
+    uint32_t jackEventCount, jackEventIndex;
+    jack_nframes_t windowStart;
+
+    /* Events received during the previous period are delivered at
+     * the same offset within this one (or within the next one, if
+     * midi_delay is set), giving a constant latency of one (or two)
+     * periods. */
+    windowStart = jack_last_frame_time(jackClient) - nframes;
+    if (midi_delay) windowStart -= nframes;
+
+    /* In pipelined mode, the period we return this time is the one
+     * the workers have been rendering since the last cycle: wait for
+     * it, then prepare the other buffer set for the next period. */
+    if (pipelined) {
+	d3h_pool_wait(workerPool);
+	outputBuffers = pluginOutputBuffers;
+	select_buffer_set(bufferSet ^ 1);
+    }
+
+    /* Anything the last cycle left for the main loop is ready now */
+    wake_main_loop();
+
+    /* Sort the JACK MIDI input (already in frame order, with exact
+     * offsets) by instance, as the producers do with theirs.  Each
+     * instance listens to only one port, so its events stay in
+     * order. */
+
+    for (p = 0; midiInputPorts && p < midiPortCount; p++) {
+	midiInputBuffer = jack_port_get_buffer(midiInputPorts[p], nframes);
+	jackEventCount = jack_midi_get_event_count(midiInputBuffer);
+	jackEventIndex = 0;
+	while (next_jack_midi_event(midiInputBuffer, jackEventCount,
+				    &jackEventIndex, &jackEvent)) {
+	    /* JACK MIDI replaces ALSA, so can use its controller state */
+	    if (!(instance = classify_event(D3H_PRODUCER_ALSA, p, &jackEvent))) continue;
+	    i = instance->number;
+	    if (jackEventCounts[i] == EVENT_BUFFER_SIZE) {
+		++jackMidiEventsDropped;
+		note_main_loop_news();
+		continue;
+	    }
+	    jackEventBuffers[i][jackEventCounts[i]++] = jackEvent;
+	}
+    }
+
+    deliver_events(nframes, windowStart);
+
+    assert(sizeof(LADSPA_Data) == sizeof(jack_default_audio_sample_t));
+
+    if (pipelined) {
+
+	/* The JACK buffers are only valid during this cycle, so the
+	 * workers have to render into our own */
+
+	for (inCount = 0; inCount < insTotal; ++inCount) {
+
+	    jack_default_audio_sample_t *buffer =
+		jack_port_get_buffer(inputPorts[inCount], nframes);
+	
+	    memcpy(pluginInputBuffers[inCount], buffer, nframes * sizeof(LADSPA_Data));
+	}
+
+	runFrames = nframes;
+	connect_audio_buffers(pluginInputBuffers, pluginOutputBuffers);
+	d3h_pool_begin(workerPool, runUnitCount);
+
+	if (busCount) {
+	    for (outCount = 0; outCount < outputPortCount; ++outCount) {
+		jackOutputBuffers[outCount] =
+		    jack_port_get_buffer(outputPorts[outCount], nframes);
+		memset(jackOutputBuffers[outCount], 0, nframes * sizeof(LADSPA_Data));
+	    }
+	    mix_into_busses(outputBuffers, nframes);
+	    return 0;
+	}
+
+	for (outCount = 0; outCount < outsTotal; ++outCount) {
+
+	    jack_default_audio_sample_t *buffer =
+		jack_port_get_buffer(outputPorts[outCount], nframes);
+	
+	    memcpy(buffer, outputBuffers[outCount], nframes * sizeof(LADSPA_Data));
+	}
+
+	return 0;
+    }
+
+    /* Otherwise the plugins can run directly on the JACK buffers */
+
+    for (inCount = 0; inCount < insTotal; ++inCount) {
+	jackInputBuffers[inCount] =
+	    jack_port_get_buffer(inputPorts[inCount], nframes);
+    }
+    for (outCount = 0; outCount < outputPortCount; ++outCount) {
+	jackOutputBuffers[outCount] =
+	    jack_port_get_buffer(outputPorts[outCount], nframes);
+    }
+
+    run_cycle(nframes);
+
+    return 0;
+}
+
+int
+sample_rate_callback(jack_nframes_t rate, void *arg)
+{
+    d3h_plugin_t *plugin;
+
+    if (rate == sample_rate) return 0;
+
+    /* The plugins were instantiated at the old rate, so this is the
+       best we can do; at least controllers will cover the right
+       ranges */
+    sample_rate = rate;
+    for (plugin = plugins; plugin; plugin = plugin->next) {
+	build_controller_tables(plugin);
+    }
+    return 0;
+}
+
+#ifdef HAVE_JACK_SET_LATENCY_CALLBACK
+static void
+merge_latency_range(jack_port_t *port, jack_latency_callback_mode_t mode,
+		    jack_latency_range_t *range, int *first)
+{
+    jack_latency_range_t portRange;
+
+    jack_port_get_latency_range(port, mode, &portRange);
+    if (*first || portRange.min < range->min) range->min = portRange.min;
+    if (*first || portRange.max > range->max) range->max = portRange.max;
+    *first = 0;
+}
+
+/* In pipelined mode our outputs are a period behind our inputs, which
+ * JACK can't know unless we tell it: report the latency of every path
+ * through us as that of the worst path, plus one period. */
+static void
+latency_callback(jack_latency_callback_mode_t mode, void *arg)
+{
+    jack_latency_range_t range;
+    int i, first = 1;
+
+    range.min = range.max = 0;
+
+    if (mode == JackCaptureLatency) {
+	for (i = 0; i < insTotal; i++) {
+	    merge_latency_range(inputPorts[i], mode, &range, &first);
+	}
+	for (i = 0; midiInputPorts && i < midiPortCount; i++) {
+	    merge_latency_range(midiInputPorts[i], mode, &range, &first);
+	}
+    } else {
+	for (i = 0; i < outputPortCount; i++) {
+	    merge_latency_range(outputPorts[i], mode, &range, &first);
+	}
+    }
+
+    range.min += jack_get_buffer_size(jackClient);
+    range.max += jack_get_buffer_size(jackClient);
+
+    if (mode == JackCaptureLatency) {
+	for (i = 0; i < outputPortCount; i++) {
+	    jack_port_set_latency_range(outputPorts[i], mode, &range);
+	}
+    } else {
+	for (i = 0; i < insTotal; i++) {
+	    jack_port_set_latency_range(inputPorts[i], mode, &range);
+	}
+	for (i = 0; midiInputPorts && i < midiPortCount; i++) {
+	    jack_port_set_latency_range(midiInputPorts[i], mode, &range);
+	}
+    }
+}
+#endif
+
+#ifndef RTLD_LOCAL
+#define RTLD_LOCAL  (0)
+#endif
+
+static const char *
+get_dssi_path(int quiet)
+{
+    static char *defaultDssiPath = 0;
+    const char *dssiPath = getenv("DSSI_PATH");
+
+    if (!dssiPath) {
+	if (!defaultDssiPath) {
+	    const char *home = getenv("HOME");
+	    if (home) {
+		defaultDssiPath = malloc(strlen(home) + 60);
+		sprintf(defaultDssiPath, "/usr/local/lib/dssi:/usr/lib/dssi:%s/.dssi", home);
+	    } else {
+		defaultDssiPath = strdup("/usr/local/lib/dssi:/usr/lib/dssi");
+	    }
+	}
+	dssiPath = defaultDssiPath;
+	if (!quiet) {
+	    fprintf(stderr, "\n%s: Warning: DSSI path not set\n%s: Defaulting to \"%s\"\n\n", myName, myName, dssiPath);
+	}
+    }
+    return dssiPath;
+}
+
+/* The plugin index, opened when first needed to find a library
+ * without loading it */
+static dssi_index_t *pluginIndex = 0;
+
+static dssi_index_t *
+get_plugin_index(void)
+{
+    char *file;
+
+    if (!pluginIndex) {
+	file = dssi_index_default_file();
+	pluginIndex = dssi_index_load(file);
+	free(file);
+    }
+    return pluginIndex;
+}
+
+/* Returns true if there is a file called dllName in any directory
+ * on the DSSI path, without loading it or reading the index */
+static int
+library_on_path(const char *dllName)
+{
+    char *path, *origPath, *element, *filePath;
+    struct stat st;
+    int found = 0;
+
+    path = strdup(get_dssi_path(1));
+    origPath = path;
+
+    while (!found && (element = strtok(path, ":")) != 0) {
+
+	path = 0;
+
+	if (element[0] != '/') continue;
+
+	filePath = (char *)malloc(strlen(element) + strlen(dllName) + 2);
+	sprintf(filePath, "%s/%s", element, dllName);
+	found = !stat(filePath, &st);
+	free(filePath);
+    }
+
+    free(origPath);
+    return found;
+}
+
+char *
+load(const char *dllName, void **dll, int quiet) /* returns directory where dll found */
+{
+    const char *dssiPath;
+    char *path, *origPath, *element, *message;
+    void *handle = 0;
+
+    /* If the dllName is an absolute path */
+    if (*dllName == '/') {
+	if ((handle = dlopen(dllName, RTLD_NOW |       /* real-time programs should not use RTLD_LAZY */
+                                      RTLD_LOCAL))) {  /* do not share symbols across plugins
+                                                        * (some systems (e.g. Mac OS X) default
+                                                        * to RTLD_GLOBAL!) */
+	    *dll = handle;
+            path = strdup(dllName);
+	    return dirname(path);
+	} else {
+	    if (!quiet) {
+		fprintf(stderr, "Cannot find DSSI or LADSPA plugin at '%s'\n", dllName);
+	    }
+	    return NULL;
+	}
+    }
+
+    dssiPath = get_dssi_path(quiet);
+
+    path = strdup(dssiPath);
+    origPath = path;
+    *dll = 0;
+
+    while ((element = strtok(path, ":")) != 0) {
+
+	char *filePath;
+
+	path = 0;
 
 	if (element[0] != '/') {
 	    if (!quiet) {
@@ -571,158 +1729,636 @@ instance_sort_cmp(const void *a, const void *b)
 
     if (ia->plugin->number != ib->plugin->number) {
         return ia->plugin->number - ib->plugin->number;
+    } else if (ia->midiPort != ib->midiPort) {
+        return ia->midiPort - ib->midiPort;
     } else {
         return ia->channel - ib->channel;
     }
 }
 
-void
-startGUI(const char *directory, const char *dllName, const char *label,
-	 const char *oscUrl, const char *instanceTag)
+/* Takes the list of executables that could be a GUI for one of the
+ * library's plugins from its plugin index entry, which is kept up to
+ * date with the library's GUI directory.  Call while the index is
+ * open, once the library is loaded. */
+static void
+read_gui_list(d3h_dll_t *dll)
 {
-    struct dirent *entry;
-    char *dllBase = strdup(dllName);
-    char *subpath;
-    DIR *subdir;
-    char *filename;
-    struct stat buf;
-    int fuzzy;
+    dssi_index_library_t *library;
+    char *dllBase, *path;
+    int i;
+
+    if (*dll->name == '/') {
+	path = strdup(dll->name);
+    } else {
+	path = (char *)malloc(strlen(dll->directory) + strlen(dll->name) + 2);
+	sprintf(path, "%s/%s", dll->directory, dll->name);
+    }
 
+    dllBase = strdup(strrchr(path, '/') + 1);
     if (strlen(dllBase) > 3 &&
         !strcasecmp(dllBase + strlen(dllBase) - 3, ".so")) {
 	dllBase[strlen(dllBase) - 3] = '\0';
     }
+    dll->guiBase = dllBase;
 
-    if (*dllBase == '/') {
-        subpath = dllBase;
-        dllBase = strdup(strrchr(subpath, '/') + 1);
-    } else {
-	subpath = (char *)malloc(strlen(directory) + strlen(dllBase) + 2);
-	sprintf(subpath, "%s/%s", directory, dllBase);
+    dll->guiCount = 0;
+    dll->guis = NULL;
+
+    if (!(library = dssi_index_get(get_plugin_index(), path))) {
+	free(path);
+	return;
     }
+    if (library->guiCount > 0) {
+	dll->guis = (char **)malloc(library->guiCount * sizeof(char *));
+	for (i = 0; i < library->guiCount; i++) {
+	    dll->guis[i] = strdup(library->guis[i]);
+	}
+	dll->guiCount = library->guiCount;
+    }
+    free(path);
+}
 
-    for (fuzzy = 0; fuzzy <= 1; ++fuzzy) {
+/* Returns the GUI executable for a plugin: the first one named for
+ * its label, or failing that for its library, or NULL if none */
+static const char *
+find_gui(d3h_plugin_t *plugin)
+{
+    d3h_dll_t *dll = plugin->dll;
+    const char *label = plugin->descriptor->LADSPA_Plugin->Label;
+    const char *name, *prefix;
+    int fuzzy, i;
 
-	if (!(subdir = opendir(subpath))) {
+    for (fuzzy = 0; fuzzy <= 1; ++fuzzy) {
+	prefix = fuzzy ? dll->guiBase : label;
+	for (i = 0; i < dll->guiCount; i++) {
+	    name = strrchr(dll->guis[i], '/') + 1;
 	    if (verbose) {
-		fprintf(stderr, "%s: can't open plugin GUI directory \"%s\"\n", myName, subpath);
+		fprintf(stderr, "checking %s against %s\n", name, prefix);
+	    }
+	    if (strlen(name) > strlen(prefix) &&
+		!strncmp(name, prefix, strlen(prefix)) &&
+		name[strlen(prefix)] == '_') {
+		return dll->guis[i];
+	    }
+	}
+    }
+
+    if (verbose) {
+	fprintf(stderr, "%s: no GUI found for plugin \"%s\" in library \"%s\"\n",
+		myName, label, dll->name);
+    }
+    return NULL;
+}
+
+/* Starts the instance's GUI, unless one we started is still running.
+ * The GUI is spawned rather than forked, so that starting one
+ * needn't copy the host.  Call with uiSendMutex held. */
+static void
+start_gui(d3h_instance_t *instance)
+{
+    d3h_plugin_t *plugin = instance->plugin;
+    const char *filename;
+    char *guiUrl, tag[24];
+    char *args[6];
+    posix_spawnattr_t attr;
+    sigset_t none;
+    pid_t pid;
+
+    if (!d3h_gui_reap(&instance->uiPid)) return;
+
+    if (!(filename = find_gui(plugin))) return;
+
+    guiUrl = (char *)malloc(strlen(oscUrl) + strlen(instance->friendly_name) + 2);
+    sprintf(guiUrl, "%s/%s", oscUrl, instance->friendly_name);
+    if (instance->midiPort == 0) {
+	snprintf(tag, 24, "channel %d", instance->channel);
+    } else {
+	snprintf(tag, 24, "port %d channel %d", instance->midiPort,
+		 instance->channel);
+    }
+
+    if (verbose) {
+	fprintf(stderr, "%s: trying to execute GUI at \"%s\"\n",
+		myName, filename);
+    }
+
+    args[0] = (char *)filename;
+    args[1] = guiUrl;
+    args[2] = plugin->dll->name;
+    args[3] = (char *)plugin->descriptor->LADSPA_Plugin->Label;
+    args[4] = tag;
+    args[5] = NULL;
+
+    /* the main loop may be keeping signals blocked */
+    sigemptyset(&none);
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setsigmask(&attr, &none);
+    posix_spawnattr_setsigdefault(&attr, &_signals);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+    if (posix_spawn(&pid, filename, NULL, &attr, args, environ) == 0) {
+	instance->uiPid = pid;
+    } else {
+	fprintf(stderr, "%s: failed to start GUI \"%s\"\n", myName, filename);
+    }
+
+    posix_spawnattr_destroy(&attr);
+    free(guiUrl);
+}
+
+/* Reaps the GUIs that have exited, so that they don't linger as
+ * zombies, and so that each can be started again.  Called from the
+ * main loop after a child has exited. */
+static void
+reap_guis(void)
+{
+    pid_t pid;
+    int i;
+
+    pthread_mutex_lock(&uiSendMutex);
+    for (i = 0; i < instance_count; i++) {
+	pid = instances[i].uiPid;
+	if (pid && d3h_gui_reap(&instances[i].uiPid) && verbose) {
+	    fprintf(stderr, "%s: GUI for %s (pid %d) has exited\n",
+		    myName, instances[i].friendly_name, (int)pid);
+	}
+    }
+    pthread_mutex_unlock(&uiSendMutex);
+}
+
+/* Reads the instance's programs again, after it is set up or
+ * configured.  The list is only read by whichever thread handles OSC,
+ * which is also the one that calls this, but the new list is built
+ * before it replaces the old one all the same.  The pending bank and
+ * program belong to the thread running the instance, so are left
+ * alone. */
+void
+query_programs(d3h_instance_t *instance)
+{
+    const DSSI_Descriptor *plugin = instance->plugin->descriptor;
+    DSSI_Program_Descriptor *programs = NULL, *old = instance->pluginPrograms;
+    int i, count = 0, oldCount = instance->pluginProgramCount;
+
+    if (plugin->get_program && plugin->select_program) {
+
+	/* Count the programs first */
+	for (count = 0; plugin->get_program(instanceHandles[instance->number], count); ++count);
+
+	if (count > 0) {
+	    programs = (DSSI_Program_Descriptor *)
+		malloc(count * sizeof(DSSI_Program_Descriptor));
+	    for (i = count - 1; i >= 0; --i) {
+		const DSSI_Program_Descriptor *descriptor =
+		    plugin->get_program(instanceHandles[instance->number], i);
+		programs[i].Bank = descriptor->Bank;
+		programs[i].Program = descriptor->Program;
+		programs[i].Name = strdup(descriptor->Name);
+		if (verbose) {
+		    printf("%s: %s program %d is MIDI bank %lu program %lu, named '%s'\n",
+			   myName, instance->friendly_name, i,
+			   programs[i].Bank, programs[i].Program, programs[i].Name);
+		}
+	    }
+	}
+    }
+
+    instance->pluginProgramCount = count;
+    instance->pluginPrograms = programs;
+
+    /* free old lot */
+    for (i = 0; i < oldCount; i++) {
+	free((void *)old[i].Name);
+    }
+    free(old);
+}
+
+/* Instantiates, connects and activates an instance, using the global
+ * buffer and control numbers already assigned to it.  Runs on the
+ * setup pool, so must touch nothing shared but its own slots. */
+static int
+set_up_instance(d3h_instance_t *instance)
+{
+    d3h_plugin_t *plugin = instance->plugin;
+    const LADSPA_Descriptor *ladspa = plugin->descriptor->LADSPA_Plugin;
+    LADSPA_Handle handle;
+    int in = instance->firstIn, out = instance->firstOut;
+    int controlIn = instance->firstControlIn, controlOut = instance->firstControlOut;
+    unsigned long j;
+    int k;
+
+    handle = ladspa->instantiate(ladspa, sample_rate);
+    if (!handle) {
+	fprintf(stderr, "\n%s: Error: Failed to instantiate instance %d!, plugin \"%s\"\n",
+		myName, instance->number, plugin->label);
+	return -1;
+    }
+    instanceHandles[instance->number] = handle;
+
+    if (projectDirectory && plugin->descriptor->configure) {
+	char *rv = plugin->descriptor->configure(handle,
+						 DSSI_PROJECT_DIRECTORY_KEY,
+						 projectDirectory);
+	if (rv) {
+	    fprintf(stderr, "%s: Warning: plugin doesn't like project directory: \"%s\"\n", myName, rv);
+	}
+    }
+
+    for (k = 0; k < MIDI_CONTROLLER_COUNT; k++) {
+	instance->controllerMap[k] = -1;
+    }
+    instance->nrpnMap = NULL;
+
+    for (j = 0; j < ladspa->PortCount; j++) {  /* j is LADSPA port number */
+
+	LADSPA_PortDescriptor pod = ladspa->PortDescriptors[j];
+
+	instance->pluginPortControlInNumbers[j] = -1;
+
+	if (LADSPA_IS_PORT_AUDIO(pod)) {
+
+	    if (LADSPA_IS_PORT_INPUT(pod)) {
+		instance->audioPortNumbers[in - instance->firstIn] = j;
+		ladspa->connect_port(handle, j, pluginInputBuffers[in++]);
+
+	    } else if (LADSPA_IS_PORT_OUTPUT(pod)) {
+		instance->audioPortNumbers[plugin->ins + out - instance->firstOut] = j;
+		ladspa->connect_port(handle, j, pluginOutputBuffers[out++]);
+	    }
+
+	} else if (LADSPA_IS_PORT_CONTROL(pod)) {
+
+	    if (LADSPA_IS_PORT_INPUT(pod)) {
+
+		pluginControlInControllers[controlIn] = DSSI_NONE;
+
+		if (plugin->descriptor->get_midi_controller_for_port) {
+
+		    int controller = plugin->descriptor->
+			get_midi_controller_for_port(handle, j);
+
+		    pluginControlInControllers[controlIn] = controller;
+
+		    /* the message buffer isn't ours to write to from here */
+		    if (controller == 0) {
+			fprintf(stderr, "%s: Buggy plugin: wants mapping for bank MSB\n", myName);
+		    } else if (controller == 32) {
+			fprintf(stderr, "%s: Buggy plugin: wants mapping for bank LSB\n", myName);
+		    } else if (DSSI_CONTROLLER_IS_SET(controller)) {
+			if (DSSI_IS_CC(controller)) {
+			    instance->controllerMap[DSSI_CC_NUMBER(controller)]
+				= controlIn;
+			}
+			if (DSSI_IS_NRPN(controller)) {
+			    if (!instance->nrpnMap) {
+				instance->nrpnMap = (long *)malloc
+				    (MIDI_NRPN_COUNT * sizeof(long));
+				for (k = 0; k < MIDI_NRPN_COUNT; k++) {
+				    instance->nrpnMap[k] = -1;
+				}
+			    }
+			    instance->nrpnMap[DSSI_NRPN_NUMBER(controller)]
+				= controlIn;
+			}
+		    }
+		}
+
+		pluginControlInInstances[controlIn] = instance;
+		pluginControlInPortNumbers[controlIn] = j;
+		instance->pluginPortControlInNumbers[j] = controlIn;
+
+		pluginControlIns[controlIn] = get_port_default(ladspa, j);
+
+		ladspa->connect_port(handle, j, &pluginControlIns[controlIn++]);
+
+	    } else if (LADSPA_IS_PORT_OUTPUT(pod)) {
+		ladspa->connect_port(handle, j, &pluginControlOuts[controlOut++]);
+	    }
+	}
+    }
+
+    if (ladspa->activate) {
+	ladspa->activate(handle);
+    }
+    if (instance->runAdding) {
+	ladspa->set_run_adding_gain(handle, instance->gain);
+    }
+    instance->inactive = 0;
+
+    return 0;
+}
+
+/* Sets up the instances of one setup job in turn: a single instance,
+ * or all those of a library whose instances may not be set up
+ * concurrently. */
+static void
+setup_job(int job, void *arg)
+{
+    int i;
+
+    for (i = setupJobStarts[job]; i < setupJobStarts[job + 1]; i++) {
+	if (set_up_instance(&instances[setupOrder[i]])) {
+	    __atomic_store_n(&setupFailed, 1, __ATOMIC_RELEASE);
+	}
+    }
+}
+
+/* Deactivates and cleans up every instance */
+static void
+deactivate_instances(void)
+{
+    d3h_instance_t *instance;
+    int i;
+
+    for (i = 0; i < instance_count; i++) {
+        instance = &instances[i];
+
+        if (instance->plugin->descriptor->LADSPA_Plugin->deactivate) {
+            instance->plugin->descriptor->LADSPA_Plugin->deactivate
+		(instanceHandles[i]);
+	}
+
+        if (instance->plugin->descriptor->LADSPA_Plugin->cleanup) {
+            instance->plugin->descriptor->LADSPA_Plugin->cleanup
+		(instanceHandles[i]);
+	}
+    }
+}
+
+/* Renders the MIDI file's events through the instances into the sound
+ * file, a block at a time and as fast as they will go, instead of
+ * running under JACK.  The instances get silence on their audio ins.
+ * Returns 0 on success. */
+static int
+render(const char *soundFile, const d3h_midi_file_event_t *events, int eventCount,
+       jack_nframes_t blockSize)
+{
+#ifdef HAVE_SNDFILE
+    SF_INFO info;
+    SNDFILE *sf;
+    const char *extension = strrchr(soundFile, '.');
+    float *silence, *interleaved, **outputs;
+    long long frame = 0, end, f;
+    jack_nframes_t n, t;
+    snd_seq_event_t ev;
+    d3h_instance_t *instance = NULL;   /* for ev, when it's still to go */
+    struct timespec start, finish;
+    double elapsed;
+    int e = 0, i;
+
+    memset(&info, 0, sizeof(info));
+    info.samplerate = sample_rate;
+    info.channels = outputPortCount;
+    if (extension && !strcasecmp(extension, ".wav")) {
+	info.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+    } else if (extension && !strcasecmp(extension, ".flac")) {
+	info.format = SF_FORMAT_FLAC | SF_FORMAT_PCM_24;
+    } else {
+	fprintf(stderr, "%s: Error: can't tell what kind of sound file \"%s\" should be (use .wav or .flac)\n",
+		myName, soundFile);
+	return 1;
+    }
+    if (!(sf = sf_open(soundFile, SFM_WRITE, &info))) {
+	fprintf(stderr, "%s: Error: can't write \"%s\": %s\n",
+		myName, soundFile, sf_strerror(NULL));
+	return 1;
+    }
+    sf_command(sf, SFC_SET_CLIPPING, NULL, SF_TRUE);
+
+    silence = (float *)calloc(blockSize, sizeof(float));
+    interleaved = (float *)malloc(blockSize * outputPortCount * sizeof(float));
+    outputs = (float **)malloc(outputPortCount * sizeof(float *));
+    for (i = 0; i < outputPortCount; i++) {
+	outputs[i] = (float *)malloc(blockSize * sizeof(float));
+    }
+
+    end = (long long)(((eventCount ? events[eventCount - 1].time : 0.0) +
+		       D3H_RENDER_TAIL) * sample_rate);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (frame < end) {
+	n = (end - frame < blockSize ? end - frame : blockSize);
+
+	/* Hand the instances this block's events as JACK MIDI would
+	 * be, at their own frames.  Each file event is converted only
+	 * once: an instance given more than it can take in one block
+	 * gets the rest at the start of the next, starting with the
+	 * converted event left in ev. */
+	for (;;) {
+	    if (!instance) {
+		if (e == eventCount) break;
+		f = (long long)(events[e].time * sample_rate + 0.5);
+		if (f >= frame + n) break;
+		if (events[e].port >= midiPortCount ||
+		    !decode_midi_event(events[e].data, events[e].size, &ev) ||
+		    !(instance = classify_event(D3H_PRODUCER_ALSA, events[e].port, &ev))) {
+		    ++e;
+		    continue;
+		}
+		++e;
+	    }
+	    i = instance->number;
+	    if (jackEventCounts[i] == EVENT_BUFFER_SIZE) break;
+	    ev.time.tick = (f > frame ? f - frame : 0);
+	    jackEventBuffers[i][jackEventCounts[i]++] = ev;
+	    instance = NULL;
+	}
+
+	deliver_events(n, 0);
+
+	for (i = 0; i < insTotal; i++) {
+	    jackInputBuffers[i] = silence;
+	}
+	for (i = 0; i < outputPortCount; i++) {
+	    jackOutputBuffers[i] = outputs[i];
+	}
+	run_cycle(n);
+
+	for (t = 0; t < n; t++) {
+	    for (i = 0; i < outputPortCount; i++) {
+		interleaved[t * outputPortCount + i] = outputs[i][t];
+	    }
+	}
+	if (sf_writef_float(sf, interleaved, n) != n) {
+	    fprintf(stderr, "%s: Error: failed writing \"%s\": %s\n",
+		    myName, soundFile, sf_strerror(sf));
+	    sf_close(sf);
+	    return 1;
+	}
+	frame += n;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    sf_close(sf);
+
+    if (jackMidiEventsDropped) {
+	fprintf(stderr, "%s: Warning: %lu MIDI event(s) could not be delivered\n",
+		myName, jackMidiEventsDropped);
+    }
+    if (verbose) {
+	elapsed = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+	fprintf(stderr, "%s: rendered %.1f seconds in %.2f (%.0fx real time)\n",
+		myName, frame / (double)sample_rate, elapsed,
+		elapsed > 0 ? frame / (double)sample_rate / elapsed : 0.0);
+    }
+
+    for (i = 0; i < outputPortCount; i++) {
+	free(outputs[i]);
+    }
+    free(outputs);
+    free(interleaved);
+    free(silence);
+    return 0;
+#else
+    fprintf(stderr, "%s: Error: this host was built without libsndfile, so can't render to \"%s\"\n",
+	    myName, soundFile);
+    return 1;
+#endif
+}
+
+/* Registers our JACK audio ports, and MIDI ports if we take MIDI
+ * from JACK.  Returns 0 on success. */
+static int
+register_jack_ports(int haveClientName)
+{
+    int i, j, in, out, reps;
+
+    in = 0;
+    out = 0;
+    reps = 0;
+    for (i = 0; i < instance_count; i++) {
+	if (i > 0 &&
+	    !strcmp(instances[i  ].plugin->descriptor->LADSPA_Plugin->Name,
+		    instances[i-1].plugin->descriptor->LADSPA_Plugin->Name)) {
+	    ++reps;
+	} else if (i < instance_count - 1 &&
+		   !strcmp(instances[i  ].plugin->descriptor->LADSPA_Plugin->Name,
+			   instances[i+1].plugin->descriptor->LADSPA_Plugin->Name)) {
+	    reps = 1;
+	} else {
+	    reps = 0;
+	}
+	for (j = 0; j < instances[i].plugin->ins; ++j) {
+	    char portName[40];
+	    if (haveClientName) {
+		/* if we're given a specific client name for the whole
+		   application, just name our individual ports by
+		   number rather than by instance
+		*/
+		sprintf(portName, "in_%d", in);
+	    } else {
+		strncpy(portName, instances[i].plugin->descriptor->LADSPA_Plugin->Name, 30);
+		if (reps > 0) {
+		    portName[25] = '\0';
+		    sprintf(portName + strlen(portName), " %d in_%d", reps, j + 1);
+		} else {
+		    portName[30] = '\0';
+		    sprintf(portName + strlen(portName), " in_%d", j + 1);
+		}
 	    }
-	    free(subpath);
-	    free(dllBase);
-	    return;
+	    inputPorts[in] = jack_port_register(jackClient, portName,
+						JACK_DEFAULT_AUDIO_TYPE,
+						JackPortIsInput, 0);
+	    ++in;
 	}
-
-	while ((entry = readdir(subdir))) {
-	    
-	    if (entry->d_name[0] == '.') continue;
-	    if (!strchr(entry->d_name, '_')) continue;
-
-	    if (fuzzy) {
-		if (verbose) {
-		    fprintf(stderr, "checking %s against %s\n", entry->d_name, dllBase);
-		}
-                if (strlen(entry->d_name) <= strlen(dllBase) ||
-                    strncmp(entry->d_name, dllBase, strlen(dllBase)) ||
-                    entry->d_name[strlen(dllBase)] != '_')
-                    continue;
+	if (busCount) continue;
+	for (j = 0; j < instances[i].plugin->outs; ++j) {
+	    char portName[40];
+	    if (haveClientName) {
+		/* if we're given a specific client name for the whole
+		   application, just name our individual ports by
+		   number rather than by instance
+		*/
+		sprintf(portName, "out_%d", out);
 	    } else {
-		if (verbose) {
-		    fprintf(stderr, "checking %s against %s\n", entry->d_name, label);
+		strncpy(portName, instances[i].plugin->descriptor->LADSPA_Plugin->Name, 30);
+		if (reps > 0) {
+		    portName[25] = '\0';
+		    sprintf(portName + strlen(portName), " %d out_%d", reps, j + 1);
+		} else {
+		    portName[30] = '\0';
+		    sprintf(portName + strlen(portName), " out_%d", j + 1);
 		}
-                if (strlen(entry->d_name) <= strlen(label) ||
-                    strncmp(entry->d_name, label, strlen(label)) ||
-                    entry->d_name[strlen(label)] != '_')
-                    continue;
 	    }
-	    
-	    filename = (char *)malloc(strlen(subpath) + strlen(entry->d_name) + 2);
-	    sprintf(filename, "%s/%s", subpath, entry->d_name);
-	    
-	    if (stat(filename, &buf)) {
-		perror("stat failed");
-		free(filename);
-		continue;
-	    }
-	    
-	    if ((S_ISREG(buf.st_mode) || S_ISLNK(buf.st_mode)) &&
-		(buf.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+	    outputPorts[out] = jack_port_register(jackClient, portName,
+						  JACK_DEFAULT_AUDIO_TYPE,
+						  JackPortIsOutput, 0);
+	    ++out;
+	}
+    }
 
-		if (verbose) {
-		    fprintf(stderr, "%s: trying to execute GUI at \"%s\"\n",
-			    myName, filename);
-		}
-		
-		if (fork() == 0) {
-		    execlp(filename, filename, oscUrl, dllName, label, instanceTag, NULL);
-		    perror("exec failed");
-		    exit(1);
-		}
-		
-		free(filename);
-		free(subpath);
-		free(dllBase);
-		return;
+    for (j = 0; j < 2 * busCount; ++j) {
+	char portName[40];
+	sprintf(portName, "bus_%d_%s", j / 2 + 1, j % 2 ? "R" : "L");
+	outputPorts[j] = jack_port_register(jackClient, portName,
+					    JACK_DEFAULT_AUDIO_TYPE,
+					    JackPortIsOutput, 0);
+    }
+    
+    if (jack_midi) {
+	midiInputPorts = (jack_port_t **)malloc(midiPortCount * sizeof(jack_port_t *));
+	for (j = 0; j < midiPortCount; j++) {
+	    char portName[40];
+	    if (midiPortCount == 1) strcpy(portName, "midi_in");
+	    else sprintf(portName, "midi_in_%d", j + 1);
+	    midiInputPorts[j] = jack_port_register(jackClient, portName,
+						   JACK_DEFAULT_MIDI_TYPE,
+						   JackPortIsInput, 0);
+	    if (!midiInputPorts[j]) {
+		fprintf(stderr, "\n%s: Error: Failed to register JACK MIDI input port\n",
+			myName);
+		return 1;
 	    }
-	    
-	    free(filename);
 	}
-    }	
-
-    if (verbose) {
-	fprintf(stderr, "%s: no GUI found for plugin \"%s\" in \"%s/\"\n",
-		myName, label, subpath);
     }
-    free(subpath);
-    free(dllBase);
+
+    return 0;
 }
 
-void
-query_programs(d3h_instance_t *instance)
+static void
+print_usage(const char *name)
 {
-    int i;
+    fprintf(stderr, "\nUsage: %s [-v] [-a] [-n] [-d] [-j] [-t <threads>] [-P] [-s <frames>] [-b <busses>] [-m <ports>] [-p <projdir>] [-c <cname>] [-r <port>:<chan>] [-o <file.wav|file.flac> -i <midifile> [-R <rate>] [-k <frames>]] [-B <bus>] [-g <gain>] [-L] [-<i>] <libname>[%c<label>] [...]\n", name, LABEL_SEP);
+    fprintf(stderr, "\n  -v        Verbose mode\n");
+    fprintf(stderr, "  -a        Don't autoconnect outputs to JACK physical outputs\n");
+    fprintf(stderr, "  -n        Don't automatically start plugin GUIs, only when sent an OSC show\n");
+    fprintf(stderr, "  -d        Delay MIDI by one more period, for constant latency\n");
+    fprintf(stderr, "  -j        Take MIDI from a JACK MIDI port instead of ALSA\n");
+    fprintf(stderr, "  <threads> Worker threads to run instances on, besides the JACK thread\n");
+    fprintf(stderr, "  -P        Render one period ahead on the worker threads, adding a period\n            of latency (implies -t 1 if -t is not given)\n");
+    fprintf(stderr, "  <frames>  Apply mapped MIDI controller changes at their own frames,\n            splitting runs into blocks of at least this many frames\n");
+    fprintf(stderr, "  <busses>  Mix all instances into this many stereo JACK outputs\n");
+    fprintf(stderr, "  <ports>   Number of MIDI input ports (max %d, default as many as needed)\n", D3H_MAX_MIDI_PORTS);
+    fprintf(stderr, "  <projdir> Project directory to pass to plugin and UI\n");
+    fprintf(stderr, "  <cname>   Client name to use for ALSA and JACK\n");
+    fprintf(stderr, "  -o <file.wav|file.flac> Render offline into this file, 32-bit float .wav\n            or 24-bit .flac by its extension, instead of running under JACK,\n            as fast as the plugins will go (needs libsndfile)\n");
+    fprintf(stderr, "  <midifile> Standard MIDI File to render\n");
+    fprintf(stderr, "  <rate>    Sample rate to render at (default 48000)\n");
+    fprintf(stderr, "  -k <frames> Block size to render in (default 256)\n");
+    fprintf(stderr, "  <port>:<chan> MIDI port and channel for the next plugin's first instance,\n            from 1:1 (default: the channel after the previous instance's)\n");
+    fprintf(stderr, "  <bus>     Bus to mix the next plugin's instances into (default 1)\n");
+    fprintf(stderr, "  <gain>    Gain in dB for the next plugin's instances on their bus (default 0)\n");
+    fprintf(stderr, "  -L        Set up the next plugin library's instances one at a time, for\n            libraries that aren't safe to instantiate from several threads\n");
+    fprintf(stderr, "  <i>       Number of instances of each plugin to run (max %d total, default 1)\n", D3H_MAX_INSTANCES);
+    fprintf(stderr, "  <libname> DSSI plugin library .so to load (searched for in $DSSI_PATH)\n");
+    fprintf(stderr, "  <label>   Label of plugin to load from library, or on its own, of a plugin\n            to find in the plugin index\n");
+    fprintf(stderr, "  [...]     Optionally more instance counts, plugins and labels\n");
+    fprintf(stderr, "\nExample: %s -2 lib1.so -1 lib2.so%cfuzzy\n", name, LABEL_SEP);
+    fprintf(stderr, "  run two instances of the first plugin found in lib1.so, assigned to MIDI\n  channels 0 and 1 and connected to the first available JACK outputs, and one\n  instance of the \"fuzzy\" plugin in lib2.so with MIDI channels 2 and 3 and\n  connected to the next available JACK outputs.\n");
+    fprintf(stderr,"\nAs a special case, if this program is started with a name other than\njack-dssi-host, and if that name (plus .so suffix) can be found in the DSSI path\nas a valid plugin library, and if no further command line arguments are given,\nthen the first plugin in that library will be loaded automatically.\n\n");
+}
 
-    /* free old lot */
-    if (instance->pluginPrograms) {
-        for (i = 0; i < instance->pluginProgramCount; i++)
-            free((void *)instance->pluginPrograms[i].Name);
-	free((char *)instance->pluginPrograms);
-	instance->pluginPrograms = NULL;
-	instance->pluginProgramCount = 0;
-    }
-
-    instance->pendingBankLSB = -1;
-    instance->pendingBankMSB = -1;
-    instance->pendingProgramChange = -1;
-
-    if (instance->plugin->descriptor->get_program &&
-        instance->plugin->descriptor->select_program) {
-
-	/* Count the plugins first */
-	for (i = 0; instance->plugin->descriptor->
-                        get_program(instanceHandles[instance->number], i); ++i);
-
-	if (i > 0) {
-	    instance->pluginProgramCount = i;
-	    instance->pluginPrograms = (DSSI_Program_Descriptor *)
-		malloc(i * sizeof(DSSI_Program_Descriptor));
-	    while (i > 0) {
-		const DSSI_Program_Descriptor *descriptor;
-		--i;
-		descriptor = instance->plugin->descriptor->
-		    get_program(instanceHandles[instance->number], i);
-		instance->pluginPrograms[i].Bank = descriptor->Bank;
-		instance->pluginPrograms[i].Program = descriptor->Program;
-		instance->pluginPrograms[i].Name = strdup(descriptor->Name);
-		if (verbose) {
-		    printf("%s: %s program %d is MIDI bank %lu program %lu, named '%s'\n",
-			   myName, instance->friendly_name, i,
-			   instance->pluginPrograms[i].Bank,
-			   instance->pluginPrograms[i].Program,
-			   instance->pluginPrograms[i].Name);
-		}
-	    }
-	}
-    }
+/* Parses s as a whole number from min to max into *value, returning
+ * 0 if it isn't one */
+static int
+parse_count(const char *s, int min, int max, int *value)
+{
+    char *end;
+    long v = strtol(s, &end, 10);
+
+    if (end == s || *end || v < min || v > max) return 0;
+    *value = v;
+    return 1;
 }
 
 int
@@ -731,22 +2367,50 @@ main(int argc, char **argv)
     int portid;
     int npfd;
     struct pollfd *pfd;
+    unsigned long midiEventsDropped[D3H_PRODUCER_COUNT];
+    unsigned long jackMidiEventsReported = 0;
+    unsigned long *eventsShedReported;
+    unsigned long *eventsDeferredReported;
+    unsigned long *uiUpdatesSuppressedReported;
+    int instancesAllocated = 0;
+    int slot = 0, route = -1;   /* MIDI port * D3H_MAX_CHANNELS + channel */
 
     d3h_dll_t *dll;
     d3h_plugin_t *plugin;
     d3h_instance_t *instance;
+    snd_seq_event_t *ev;
     void *pluginObject;
+    dssi_index_library_t *library;
     char *dllName;
     char *label;
     const char **ports;
     char *tmp;
-    char *url;
-    int i, reps, j;
+    int i, reps, j, s, frames;
+    int bus = 0;
+    int serialSetup = 0;
+    int setupJobs;
+    long cpus;
+    d3h_pool_t *setupPool = NULL;
+    float gain = 1.0f;
     int in, out, controlIn, controlOut;
     char clientName[33];
     int haveClientName = 0;
     const int clientLen = 32;
     jack_status_t status;
+    jack_nframes_t bufferSize;
+    const char *renderFile = NULL, *renderMidiFile = NULL;
+    d3h_midi_file_event_t *renderEvents = NULL;
+    int renderEventCount = 0, renderRate = 48000, renderFrames = 256;
+#ifdef D3H_EPOLL
+    int epollFd, signalFd, nready, alsaReady, k;
+    struct epoll_event waitEvent, readyEvents[D3H_WAIT_EVENTS];
+    struct signalfd_siginfo signalInfo;
+    sigset_t waitSignals;
+    uint64_t wakes;
+    int timeout;
+#endif
+    struct timespec now;
+    long long nowMs, nextUiSendMs = 0;
 
     setsid();
     sigemptyset (&_signals);
@@ -757,10 +2421,15 @@ main(int argc, char **argv)
     sigaddset(&_signals, SIGTERM);
     sigaddset(&_signals, SIGUSR1);
     sigaddset(&_signals, SIGUSR2);
+    sigaddset(&_signals, SIGCHLD);
     pthread_sigmask(SIG_BLOCK, &_signals, 0);
 
     insTotal = outsTotal = controlInsTotal = controlOutsTotal = 0;
 
+    for (i = 0; i < D3H_PRODUCER_COUNT; i++) {
+        midiEventsDropped[i] = 0;
+    }
+
     /* Handle run-plugin-from-executable-name special case */
 
     if (argc == 1) {
@@ -770,11 +2439,12 @@ main(int argc, char **argv)
 	else ++basename;
 
 	if (basename[0] && strcmp(basename, "jack-dssi-host")) {
-	    /* look for basename + .so as plugin */
+	    /* look for basename + .so as plugin, in the index rather
+	       than by loading it twice */
 	    dllName = malloc(strlen(basename) + 4);
 	    sprintf(dllName, "%s.so", basename);
-	    if (load(dllName, &pluginObject, 1)) {
-		dlclose(pluginObject);
+	    library = dssi_index_find_library(get_plugin_index(), get_dssi_path(1), dllName);
+	    if (library && library->type != DSSI_INDEX_NONE) {
 		argc = 2;
 		myName = strdup(argv[0]);
 		argv = (char **)malloc(2 * sizeof(char *));
@@ -789,19 +2459,7 @@ main(int argc, char **argv)
     /* Parse args and report usage */
 
     if (argc < 2) {
-	fprintf(stderr, "\nUsage: %s [-v] [-a] [-n] [-p <projdir>] [-c <cname>] [-<i>] <libname>[%c<label>] [...]\n", argv[0], LABEL_SEP);
-	fprintf(stderr, "\n  -v        Verbose mode\n");
-	fprintf(stderr, "  -a        Don't autoconnect outputs to JACK physical outputs\n");
-	fprintf(stderr, "  -n        Don't automatically start plugin GUIs\n");
-	fprintf(stderr, "  <projdir> Project directory to pass to plugin and UI\n");
-	fprintf(stderr, "  <cname>   Client name to use for ALSA and JACK\n");
-	fprintf(stderr, "  <i>       Number of instances of each plugin to run (max %d total, default 1)\n", D3H_MAX_INSTANCES);
-	fprintf(stderr, "  <libname> DSSI plugin library .so to load (searched for in $DSSI_PATH)\n");
-	fprintf(stderr, "  <label>   Label of plugin to load from library\n");
-	fprintf(stderr, "  [...]     Optionally more instance counts, plugins and labels\n");
-	fprintf(stderr, "\nExample: %s -2 lib1.so -1 lib2.so%cfuzzy\n", argv[0], LABEL_SEP);
-	fprintf(stderr, "  run two instances of the first plugin found in lib1.so, assigned to MIDI\n  channels 0 and 1 and connected to the first available JACK outputs, and one\n  instance of the \"fuzzy\" plugin in lib2.so with MIDI channels 2 and 3 and\n  connected to the next available JACK outputs.\n");
-	fprintf(stderr,"\nAs a special case, if this program is started with a name other than\njack-dssi-host, and if that name (plus .so suffix) can be found in the DSSI path\nas a valid plugin library, and if no further command line arguments are given,\nthen the first plugin in that library will be loaded automatically.\n\n");
+	print_usage(argv[0]);
 	return 2;
     }
    
@@ -826,6 +2484,112 @@ main(int argc, char **argv)
 	    load_guis = 0;
 	    continue;
 	}
+	if (!strcmp(argv[i], "-d")) {
+	    midi_delay = 1;
+	    continue;
+	}
+	if (!strcmp(argv[i], "-j")) {
+	    jack_midi = 1;
+	    continue;
+	}
+
+	if (!strcmp(argv[i], "-t")) {
+	    if (i < argc - 1 &&
+		parse_count(argv[i + 1], 0, D3H_MAX_INSTANCES, &worker_threads)) {
+		++i;
+	    } else {
+		fprintf(stderr, "%s: number of threads (0 to %d) expected after -t\n",
+			myName, D3H_MAX_INSTANCES);
+		print_usage(argv[0]);
+		return 2;
+	    }
+	    continue;
+	}
+
+	if (!strcmp(argv[i], "-P")) {
+	    pipelined = 1;
+	    continue;
+	}
+
+	if (!strcmp(argv[i], "-s")) {
+	    if (i < argc - 1 &&
+		parse_count(argv[i + 1], 1, D3H_MAX_FRAMES, &frames)) {
+		splitFrames = frames;
+		++i;
+	    } else {
+		fprintf(stderr, "%s: minimum number of frames (1 to %d) expected after -s\n",
+			myName, D3H_MAX_FRAMES);
+		print_usage(argv[0]);
+		return 2;
+	    }
+	    continue;
+	}
+
+	if (!strcmp(argv[i], "-b")) {
+	    if (i < argc - 1 &&
+		parse_count(argv[i + 1], 1, D3H_MAX_INSTANCES, &busCount)) {
+		++i;
+	    } else {
+		fprintf(stderr, "%s: number of busses (1 to %d) expected after -b\n",
+			myName, D3H_MAX_INSTANCES);
+		print_usage(argv[0]);
+		return 2;
+	    }
+	    continue;
+	}
+
+	if (!strcmp(argv[i], "-m")) {
+	    if (i < argc - 1 &&
+		parse_count(argv[i + 1], 1, D3H_MAX_MIDI_PORTS, &midiPortCount)) {
+		++i;
+	    } else {
+		fprintf(stderr, "%s: number of MIDI ports (1 to %d) expected after -m\n",
+			myName, D3H_MAX_MIDI_PORTS);
+		print_usage(argv[0]);
+		return 2;
+	    }
+	    continue;
+	}
+
+	if (!strcmp(argv[i], "-r")) {
+	    int port, channel;
+	    if (i < argc - 1 &&
+		sscanf(argv[i + 1], "%d:%d", &port, &channel) == 2 &&
+		port > 0 && port <= D3H_MAX_MIDI_PORTS &&
+		channel > 0 && channel <= D3H_MAX_CHANNELS) {
+		route = (port - 1) * D3H_MAX_CHANNELS + channel - 1;
+		++i;
+	    } else {
+		fprintf(stderr, "%s: MIDI port and channel expected after -r, as <port>:<channel>\n", myName);
+		return 2;
+	    }
+	    continue;
+	}
+
+	if (!strcmp(argv[i], "-B")) {
+	    if (i < argc - 1 && atoi(argv[i + 1]) > 0) {
+		bus = atoi(argv[++i]) - 1;
+	    } else {
+		fprintf(stderr, "%s: bus number expected after -B\n", myName);
+		return 2;
+	    }
+	    continue;
+	}
+
+	if (!strcmp(argv[i], "-g")) {
+	    if (i < argc - 1) {
+		gain = powf(10.0f, atof(argv[++i]) / 20.0f);
+	    } else {
+		fprintf(stderr, "%s: gain in dB expected after -g\n", myName);
+		return 2;
+	    }
+	    continue;
+	}
+
+	if (!strcmp(argv[i], "-L")) {
+	    serialSetup = 1;
+	    continue;
+	}
 
 	if (!strcmp(argv[i], "-p")) {
 	    if (i < argc - 1) {
@@ -837,6 +2601,53 @@ main(int argc, char **argv)
 	    continue;
 	}
 
+	if (!strcmp(argv[i], "-o")) {
+	    if (i < argc - 1) {
+		renderFile = argv[++i];
+	    } else {
+		fprintf(stderr, "%s: sound file expected after -o\n", myName);
+		return 2;
+	    }
+	    continue;
+	}
+
+	if (!strcmp(argv[i], "-i")) {
+	    if (i < argc - 1) {
+		renderMidiFile = argv[++i];
+	    } else {
+		fprintf(stderr, "%s: MIDI file expected after -i\n", myName);
+		return 2;
+	    }
+	    continue;
+	}
+
+	if (!strcmp(argv[i], "-R")) {
+	    if (i < argc - 1 &&
+		parse_count(argv[i + 1], D3H_MIN_RENDER_RATE, D3H_MAX_RENDER_RATE,
+			    &renderRate)) {
+		++i;
+	    } else {
+		fprintf(stderr, "%s: sample rate (%d to %d) expected after -R\n",
+			myName, D3H_MIN_RENDER_RATE, D3H_MAX_RENDER_RATE);
+		print_usage(argv[0]);
+		return 2;
+	    }
+	    continue;
+	}
+
+	if (!strcmp(argv[i], "-k")) {
+	    if (i < argc - 1 &&
+		parse_count(argv[i + 1], 1, D3H_MAX_FRAMES, &renderFrames)) {
+		++i;
+	    } else {
+		fprintf(stderr, "%s: block size in frames (1 to %d) expected after -k\n",
+			myName, D3H_MAX_FRAMES);
+		print_usage(argv[0]);
+		return 2;
+	    }
+	    continue;
+	}
+
 	if (!strcmp(argv[i], "-c")) {
 	    if (i < argc - 1) {
 		strncpy(clientName, argv[++i], clientLen);
@@ -873,6 +2684,19 @@ main(int argc, char **argv)
         } else {
             dllName = strdup(argv[i]);
             label = NULL;
+
+            /* a label alone will do, if no library has that name */
+            if (!strchr(dllName, '/') &&
+                !library_on_path(dllName) &&
+                (library = dssi_index_find_label(get_plugin_index(), get_dssi_path(1),
+                                                 dllName, NULL))) {
+                if (verbose) {
+                    fprintf(stderr, "%s: Found plugin \"%s\" in library %s\n",
+                            myName, dllName, library->path);
+                }
+                label = dllName;
+                dllName = strdup(library->filename);
+            }
         }
 
         /* check if we've seen this plugin before */
@@ -931,6 +2755,10 @@ main(int argc, char **argv)
                     dll->is_DSSI_dll = 0;
                 }
 
+                if (!renderFile) {
+                    read_gui_list(dll);
+                }
+
                 dll->next = dlls;
                 dlls = dll;
             }
@@ -1009,13 +2837,31 @@ main(int argc, char **argv)
         /* set up instances */
         for (j = 0; j < reps; j++) {
             if (instance_count < D3H_MAX_INSTANCES) {
+                if (instance_count == instancesAllocated) {
+                    instancesAllocated = (instancesAllocated ?
+                                          2 * instancesAllocated : D3H_MAX_CHANNELS);
+                    instances = (d3h_instance_t *)realloc
+                        (instances, instancesAllocated * sizeof(d3h_instance_t));
+                }
                 instance = &instances[instance_count];
+                memset(instance, 0, sizeof(d3h_instance_t));
+
+                if (j == 0 && route >= 0) {
+                    slot = route;
+                }
+                if (slot >= D3H_MAX_INSTANCES) {
+                    fprintf(stderr, "%s: no MIDI channels left for instance of \"%s\"\n",
+                            myName, plugin->label);
+                    return 2;
+                }
 
                 instance->plugin = plugin;
-                instance->channel = instance_count;
+                instance->midiPort = slot / D3H_MAX_CHANNELS;
+                instance->channel = slot % D3H_MAX_CHANNELS;
+                ++slot;
 		instance->inactive = 1;
                 tmp = (char *)malloc(strlen(plugin->dll->name) +
-                                     strlen(plugin->label) + 9);
+                                     strlen(plugin->label) + 20);
                 instance->friendly_name = tmp;
                 strcpy(tmp, plugin->dll->name);
                 if (strlen(tmp) > 3 &&
@@ -1024,7 +2870,12 @@ main(int argc, char **argv)
                 } else {
                     tmp = tmp + strlen(tmp);
                 }
-                sprintf(tmp, "/%s/chan%02d", plugin->label, instance->channel);
+                if (instance->midiPort == 0) {
+                    sprintf(tmp, "/%s/chan%02d", plugin->label, instance->channel);
+                } else {
+                    sprintf(tmp, "/%s/port%02d-chan%02d", plugin->label,
+                            instance->midiPort, instance->channel);
+                }
                 instance->pluginProgramCount = 0;
                 instance->pluginPrograms = NULL;
                 instance->currentBank = 0;
@@ -1032,15 +2883,31 @@ main(int argc, char **argv)
                 instance->pendingBankLSB = -1;
                 instance->pendingBankMSB = -1;
                 instance->pendingProgramChange = -1;
+                instance->uiPid = 0;
                 instance->uiTarget = NULL;
 		instance->uiSource = NULL;
+		instance->uiSourceKey = 0;
                 instance->ui_initial_show_sent = 0;
                 instance->uiNeedsProgramUpdate = 0;
+                instance->uiProgramQueued = 0;
+                instance->uiDirtyControls = NULL;
+                instance->uiDirtyCount = 0;
+                instance->uiProgramDirty = 0;
+                instance->uiConfigures = NULL;
+                instance->uiShowPending = 0;
+                instance->uiMessageAllowance = UI_BURST_MESSAGES;
+                instance->uiByteAllowance = UI_BURST_BYTES;
+                instance->uiAllowanceTime = 0;
+                instance->uiUpdatesSuppressed = 0;
                 instance->ui_osc_control_path = NULL;
+                instance->ui_osc_configure_path = NULL;
                 instance->ui_osc_program_path = NULL;
                 instance->ui_osc_quit_path = NULL;
                 instance->ui_osc_rate_path = NULL;
                 instance->ui_osc_show_path = NULL;
+                instance->bus = bus;
+                instance->gain = gain;
+                instance->runAdding = 0;
 
                 insTotal += plugin->ins;
                 outsTotal += plugin->outs;
@@ -1054,7 +2921,20 @@ main(int argc, char **argv)
                 return 2;
             }
         }
+        if (serialSetup) {
+            plugin->dll->serialSetup = 1;
+        }
         reps = 1;
+        bus = 0;
+        gain = 1.0f;
+        route = -1;
+        serialSetup = 0;
+    }
+
+    if (pluginIndex) {
+	dssi_index_save(pluginIndex);
+	dssi_index_free(pluginIndex);
+	pluginIndex = 0;
     }
 
     if (instance_count == 0) {
@@ -1062,23 +2942,103 @@ main(int argc, char **argv)
 	return 2;
     }
 
+    if (renderFile || renderMidiFile) {
+	const char *error;
+
+	if (!renderFile || !renderMidiFile) {
+	    fprintf(stderr, "%s: -o and -i must be given together\n", myName);
+	    return 2;
+	}
+	if (!(renderEvents = d3h_midi_file_read(renderMidiFile, &renderEventCount, &error))) {
+	    fprintf(stderr, "%s: Error: can't read MIDI file \"%s\": %s\n",
+		    myName, renderMidiFile, error);
+	    return 1;
+	}
+	/* there is nothing to look at, nor to keep pace with */
+	load_guis = 0;
+	pipelined = 0;
+	jack_midi = 0;
+    }
+
     /* sort array of instances to group them by plugin */
     if (instance_count > 1) {
         qsort(instances, instance_count, sizeof(d3h_instance_t), instance_sort_cmp);
     }
 
+    /* we need enough MIDI ports for all the instances */
+    for (i = 0, j = 0; i < instance_count; i++) {
+        if (instances[i].midiPort >= j) j = instances[i].midiPort + 1;
+    }
+    if (midiPortCount == 0) {
+        midiPortCount = j;
+    } else if (j > midiPortCount) {
+        fprintf(stderr, "%s: instances need %d MIDI ports, but only %d were asked for\n",
+                myName, j, midiPortCount);
+        return 2;
+    }
+
     /* build channel2instance[] while showing what our instances are */
-    for (i = 0; i < D3H_MAX_CHANNELS; i++)
-        channel2instance[i] = NULL;
+    channel2instance = (d3h_instance_t **)calloc(midiPortCount * D3H_MAX_CHANNELS,
+                                                 sizeof(d3h_instance_t *));
     for (i = 0; i < instance_count; i++) {
         instance = &instances[i];
         instance->number = i;
-        channel2instance[instance->channel] = instance;
+        j = instance->midiPort * D3H_MAX_CHANNELS + instance->channel;
+        if (channel2instance[j]) {
+            fprintf(stderr, "%s: \"%s\" and \"%s\" are both on MIDI port %d channel %d\n",
+                    myName, channel2instance[j]->friendly_name, instance->friendly_name,
+                    instance->midiPort + 1, instance->channel + 1);
+            return 2;
+        }
+        channel2instance[j] = instance;
 	if (verbose) {
-	    fprintf(stderr, "%s: instance %2d on channel %2d, plugin %2d is \"%s\"\n",
-		    myName, i, instance->channel, instance->plugin->number,
-		    instance->friendly_name);
+	    fprintf(stderr, "%s: instance %2d on port %d channel %2d, plugin %2d is \"%s\"\n",
+		    myName, i, instance->midiPort, instance->channel,
+		    instance->plugin->number, instance->friendly_name);
 	}
+	if (busCount && instance->bus >= busCount) {
+	    fprintf(stderr, "%s: instance %d is assigned to bus %d, but there are only %d busses\n",
+		    myName, i, instance->bus + 1, busCount);
+	    return 2;
+	}
+    }
+    outputPortCount = (busCount ? 2 * busCount : outsTotal);
+
+    /* Create the event rings and counters, now we know how many
+     * instances there are */
+
+    for (i = 0; i < D3H_PRODUCER_COUNT; i++) {
+        midiEventBuffers[i] = (snd_seq_event_t *)malloc(instance_count * EVENT_BUFFER_SIZE *
+                                                        sizeof(snd_seq_event_t));
+        midiEventRings[i] = (d3h_event_ring_t *)malloc(instance_count *
+                                                       sizeof(d3h_event_ring_t));
+        for (j = 0; j < instance_count; j++) {
+            d3h_event_ring_init(&midiEventRings[i][j],
+                                midiEventBuffers[i] + j * EVENT_BUFFER_SIZE,
+                                EVENT_BUFFER_SIZE);
+        }
+    }
+    jackEventCounts = (unsigned long *)calloc(instance_count, sizeof(unsigned long));
+    eventsShed = (unsigned long *)calloc(instance_count, sizeof(unsigned long));
+    eventsDeferred = (unsigned long *)calloc(instance_count, sizeof(unsigned long));
+    eventsShedReported = (unsigned long *)calloc(instance_count, sizeof(unsigned long));
+    eventsDeferredReported = (unsigned long *)calloc(instance_count, sizeof(unsigned long));
+    uiUpdatesSuppressedReported = (unsigned long *)calloc(instance_count, sizeof(unsigned long));
+
+    /* Divide the instances into run units */
+
+    runUnits = (d3h_run_unit_t *)malloc(instance_count * sizeof(d3h_run_unit_t));
+    i = out = 0;
+    while (i < instance_count) {
+	d3h_run_unit_t *unit = &runUnits[runUnitCount++];
+	plugin = instances[i].plugin;
+	unit->first = i;
+	unit->count = (plugin->descriptor->run_multiple_synths ?
+		       plugin->instances : 1);
+	unit->firstOut = out;
+	unit->outs = unit->count * plugin->outs;
+	out += unit->outs;
+	i += unit->count;
     }
 
     /* Create buffers and JACK client and ports */
@@ -1091,153 +3051,188 @@ main(int argc, char **argv)
 	}
     }
 
-    if ((jackClient = jack_client_open(clientName, 0, &status)) == 0) {
-        fprintf(stderr, "\n%s: Error: Failed to connect to JACK server\n",
-            myName);
-        return 1;
-    }
-    if (status & JackNameNotUnique) {
-        strncpy(clientName, jack_get_client_name(jackClient), clientLen);
-	clientName[clientLen] = '\0';
+    if (renderFile) {
+	sample_rate = renderRate;
+	bufferSize = renderFrames;
+    } else {
+	if ((jackClient = jack_client_open(clientName, 0, &status)) == 0) {
+	    fprintf(stderr, "\n%s: Error: Failed to connect to JACK server\n",
+		    myName);
+	    return 1;
+	}
+	if (status & JackNameNotUnique) {
+	    strncpy(clientName, jack_get_client_name(jackClient), clientLen);
+	    clientName[clientLen] = '\0';
+	}
+
+	sample_rate = jack_get_sample_rate(jackClient);
+	bufferSize = jack_get_buffer_size(jackClient);
     }
 
-    sample_rate = jack_get_sample_rate(jackClient);
+    if (pipelined) {
+	/* the JACK thread only runs units left over when it comes to
+	   collect them, so we want a worker for each unit if we can */
+	if (worker_threads < 1) {
+	    worker_threads = 1;
+	} else if (worker_threads > runUnitCount) {
+	    worker_threads = runUnitCount;
+	}
+    } else if (worker_threads > runUnitCount - 1) {
+	/* the JACK thread runs units too, so we need one fewer worker
+	   than there are units */
+	worker_threads = runUnitCount - 1;
+    }
+    if (worker_threads > 0) {
+	workerPool = d3h_pool_new(worker_threads,
+				  jackClient && jack_is_realtime(jackClient) ?
+				  jack_client_real_time_priority(jackClient) : 0,
+				  run_unit, NULL);
+	if (!workerPool) {
+	    fprintf(stderr, "%s: Warning: failed to start worker threads, running instances serially\n", myName);
+	    pipelined = 0;
+	} else if (verbose) {
+	    fprintf(stderr, "%s: running %d units on %d worker threads%s\n",
+		    myName, runUnitCount, worker_threads,
+		    pipelined ? ", one period ahead" : "");
+	}
+    }
 
     inputPorts = (jack_port_t **)malloc(insTotal * sizeof(jack_port_t *));
-    pluginInputBuffers = (float **)malloc(insTotal * sizeof(float *));
     pluginControlIns = (float *)calloc(controlInsTotal, sizeof(float));
     pluginControlInInstances =
         (d3h_instance_t **)malloc(controlInsTotal * sizeof(d3h_instance_t *));
     pluginControlInPortNumbers =
         (unsigned long *)malloc(controlInsTotal * sizeof(unsigned long));
     pluginPortUpdated = (int *)malloc(controlInsTotal * sizeof(int));
-
-    outputPorts = (jack_port_t **)malloc(outsTotal * sizeof(jack_port_t *));
-    pluginOutputBuffers = (float **)malloc(outsTotal * sizeof(float *));
+    uiControlDirty = (char *)calloc(controlInsTotal, sizeof(char));
+    uiControlValues = (float *)calloc(controlInsTotal, sizeof(float));
+    pluginControlInControllers = (int *)malloc(controlInsTotal * sizeof(int));
+    controllerValueTables = (float **)calloc(controlInsTotal, sizeof(float *));
+    fineValueTables = (float **)calloc(controlInsTotal, sizeof(float *));
+
+    outputPorts = (jack_port_t **)malloc(outputPortCount * sizeof(jack_port_t *));
+    jackInputBuffers = (float **)malloc(insTotal * sizeof(float *));
+    jackOutputBuffers = (float **)malloc(outputPortCount * sizeof(float *));
+    runOutputBuffers = (float **)malloc(outsTotal * sizeof(float *));
     pluginControlOuts = (float *)calloc(controlOutsTotal, sizeof(float));
 
     instanceHandles = (LADSPA_Handle *)malloc(instance_count *
                                               sizeof(LADSPA_Handle));
-    instanceEventBuffers = (snd_seq_event_t **)malloc(instance_count *
-                                                      sizeof(snd_seq_event_t *));
-    instanceEventCounts = (unsigned long *)malloc(instance_count *
-                                                  sizeof(unsigned long));
-
-    for (i = 0; i < instance_count; i++) {
-        instanceEventBuffers[i] = (snd_seq_event_t *)malloc(EVENT_BUFFER_SIZE *
-                                                            sizeof(snd_seq_event_t));
-        instances[i].pluginPortControlInNumbers =
-            (int *)malloc(instances[i].plugin->descriptor->LADSPA_Plugin->PortCount *
-                          sizeof(int));
-    }
 
-    in = 0;
-    out = 0;
-    reps = 0;
-    for (i = 0; i < instance_count; i++) {
-	if (i > 0 &&
-	    !strcmp(instances[i  ].plugin->descriptor->LADSPA_Plugin->Name,
-		    instances[i-1].plugin->descriptor->LADSPA_Plugin->Name)) {
-	    ++reps;
-	} else if (i < instance_count - 1 &&
-		   !strcmp(instances[i  ].plugin->descriptor->LADSPA_Plugin->Name,
-			   instances[i+1].plugin->descriptor->LADSPA_Plugin->Name)) {
-	    reps = 1;
-	} else {
-	    reps = 0;
+    for (s = 0; s < (pipelined ? D3H_BUFFER_SETS : 1); s++) {
+	pluginInputBufferSets[s] = (float **)malloc(insTotal * sizeof(float *));
+	pluginOutputBufferSets[s] = (float **)malloc(outsTotal * sizeof(float *));
+	for (in = 0; in < insTotal; in++) {
+	    pluginInputBufferSets[s][in] =
+		(float *)calloc(bufferSize, sizeof(float));
 	}
-	for (j = 0; j < instances[i].plugin->ins; ++j) {
-	    char portName[40];
-	    if (haveClientName) {
-		/* if we're given a specific client name for the whole
-		   application, just name our individual ports by
-		   number rather than by instance
-		*/
-		sprintf(portName, "in_%d", in);
-	    } else {
-		strncpy(portName, instances[i].plugin->descriptor->LADSPA_Plugin->Name, 30);
-		if (reps > 0) {
-		    portName[25] = '\0';
-		    sprintf(portName + strlen(portName), " %d in_%d", reps, j + 1);
-		} else {
-		    portName[30] = '\0';
-		    sprintf(portName + strlen(portName), " in_%d", j + 1);
-		}
-	    }
-	    inputPorts[in] = jack_port_register(jackClient, portName,
-						JACK_DEFAULT_AUDIO_TYPE,
-						JackPortIsInput, 0);
-	    pluginInputBuffers[in] =
-		(float *)calloc(jack_get_buffer_size(jackClient), sizeof(float));
-	    ++in;
+	for (out = 0; out < outsTotal; out++) {
+	    pluginOutputBufferSets[s][out] =
+		(float *)calloc(bufferSize, sizeof(float));
 	}
-	for (j = 0; j < instances[i].plugin->outs; ++j) {
-	    char portName[40];
-	    if (haveClientName) {
-		/* if we're given a specific client name for the whole
-		   application, just name our individual ports by
-		   number rather than by instance
-		*/
-		sprintf(portName, "out_%d", out);
-	    } else {
-		strncpy(portName, instances[i].plugin->descriptor->LADSPA_Plugin->Name, 30);
-		if (reps > 0) {
-		    portName[25] = '\0';
-		    sprintf(portName + strlen(portName), " %d out_%d", reps, j + 1);
-		} else {
-		    portName[30] = '\0';
-		    sprintf(portName + strlen(portName), " out_%d", j + 1);
-		}
-	    }
-	    outputPorts[out] = jack_port_register(jackClient, portName,
-						  JACK_DEFAULT_AUDIO_TYPE,
-						  JackPortIsOutput, 0);
-	    pluginOutputBuffers[out] =
-		(float *)calloc(jack_get_buffer_size(jackClient), sizeof(float));
-	    ++out;
+	instanceEventBufferSets[s] =
+	    (snd_seq_event_t **)malloc(instance_count * sizeof(snd_seq_event_t *));
+	instanceEventCountSets[s] =
+	    (unsigned long *)calloc(instance_count, sizeof(unsigned long));
+	for (i = 0; i < instance_count; i++) {
+	    instanceEventBufferSets[s][i] =
+		(snd_seq_event_t *)malloc(EVENT_BUFFER_SIZE * sizeof(snd_seq_event_t));
+	}
+	instanceControlBufferSets[s] =
+	    (snd_seq_event_t **)malloc(instance_count * sizeof(snd_seq_event_t *));
+	instanceControlCountSets[s] =
+	    (unsigned long *)calloc(instance_count, sizeof(unsigned long));
+	for (i = 0; i < instance_count; i++) {
+	    instanceControlBufferSets[s][i] =
+		(snd_seq_event_t *)malloc(EVENT_BUFFER_SIZE * sizeof(snd_seq_event_t));
 	}
     }
-    
-    jack_set_process_callback(jackClient, audio_callback, 0);
+    splitEventBuffers =
+	(snd_seq_event_t **)malloc(instance_count * sizeof(snd_seq_event_t *));
+    splitEventCounts = (unsigned long *)malloc(instance_count * sizeof(unsigned long));
+    splitEventIndex = (unsigned long *)malloc(instance_count * sizeof(unsigned long));
+    splitControlIndex = (unsigned long *)malloc(instance_count * sizeof(unsigned long));
+
+    uiChangeRings = (d3h_event_ring_t *)malloc(instance_count * sizeof(d3h_event_ring_t));
+    for (i = 0, s = 0; i < instance_count; i++) {
+	for (j = 1; j < instances[i].plugin->controlIns + 1; j <<= 1);
+	s += j;
+    }
+    uiChangeBuffers = (snd_seq_event_t *)malloc(s * sizeof(snd_seq_event_t));
+    for (i = 0, s = 0; i < instance_count; i++) {
+	/* room for every control in and the program */
+	for (j = 1; j < instances[i].plugin->controlIns + 1; j <<= 1);
+	d3h_event_ring_init(&uiChangeRings[i], uiChangeBuffers + s, j);
+	s += j;
+    }
+    select_buffer_set(0);
+
+    for (i = 0; i < instance_count; i++) {
+        instances[i].pluginPortControlInNumbers =
+            (int *)malloc(instances[i].plugin->descriptor->LADSPA_Plugin->PortCount *
+                          sizeof(int));
+        instances[i].uiDirtyControls =
+            (int *)malloc(instances[i].plugin->controlIns * sizeof(int));
+        instances[i].controllerStates =
+            (d3h_controller_state_t *)calloc(D3H_PRODUCER_COUNT,
+                                             sizeof(d3h_controller_state_t));
+        instances[i].audioPortNumbers =
+            (unsigned long *)malloc((instances[i].plugin->ins +
+                                     instances[i].plugin->outs) *
+                                    sizeof(unsigned long));
+    }
 
-    /* Instantiate plugins */
+    if (!renderFile && register_jack_ports(haveClientName)) {
+	return 1;
+    }
 
-    for (i = 0; i < instance_count; i++) {
-        plugin = instances[i].plugin;
-        instanceHandles[i] = plugin->descriptor->LADSPA_Plugin->instantiate
-            (plugin->descriptor->LADSPA_Plugin, sample_rate);
-        if (!instanceHandles[i]) {
-            fprintf(stderr, "\n%s: Error: Failed to instantiate instance %d!, plugin \"%s\"\n",
-                    myName, i, plugin->label);
-            return 1;
-        }
-	if (projectDirectory && plugin->descriptor->configure) {
-	    char *rv =plugin->descriptor->configure(instanceHandles[i],
-						    DSSI_PROJECT_DIRECTORY_KEY,
-						    projectDirectory);
-	    if (rv) {
-		fprintf(stderr, "%s: Warning: plugin doesn't like project directory: \"%s\"\n", myName, rv);
-	    }
+    if (jack_midi || renderFile) {
+	jackEventBuffers = (snd_seq_event_t **)malloc(instance_count *
+						      sizeof(snd_seq_event_t *));
+	for (i = 0; i < instance_count; i++) {
+	    jackEventBuffers[i] = (snd_seq_event_t *)malloc(EVENT_BUFFER_SIZE *
+							    sizeof(snd_seq_event_t));
 	}
     }
 
-    /* Create OSC thread */
+    if (!renderFile) {
+	jack_set_process_callback(jackClient, audio_callback, 0);
+	jack_set_sample_rate_callback(jackClient, sample_rate_callback, 0);
+    }
 
-    serverThread = lo_server_thread_new(NULL, osc_error);
-    snprintf((char *)osc_path_tmp, 31, "/dssi");
-    tmp = lo_server_thread_get_url(serverThread);
-    url = (char *)malloc(strlen(tmp) + strlen(osc_path_tmp));
-    sprintf(url, "%s%s", tmp, osc_path_tmp + 1);
-    if (verbose) {
-	printf("%s: registering %s\n", myName, url);
+    if (pipelined) {
+#ifdef HAVE_JACK_SET_LATENCY_CALLBACK
+	jack_set_latency_callback(jackClient, latency_callback, 0);
+#else
+	fprintf(stderr, "%s: Warning: this JACK can't be told about the extra period of latency\n", myName);
+#endif
     }
-    free(tmp);
 
-    lo_server_thread_add_method(serverThread, NULL, NULL, osc_message_handler,
-				NULL);
-    lo_server_thread_start(serverThread);
+    /* In bus mode, instances that can add their output into a bus
+     * themselves do so, unless they run on worker threads, where
+     * they would race to add into the same bus */
+
+    if (busCount && !workerPool) {
+	for (i = 0; i < runUnitCount; i++) {
+	    const DSSI_Descriptor *desc = instances[runUnits[i].first].plugin->descriptor;
+	    int adding =
+		instances[runUnits[i].first].plugin->outs == 2 &&
+		desc->LADSPA_Plugin->set_run_adding_gain &&
+		(desc->run_multiple_synths ? desc->run_multiple_synths_adding != NULL :
+		 desc->run_synth ? desc->run_synth_adding != NULL :
+		 desc->LADSPA_Plugin->run_adding != NULL);
+	    for (j = 0; j < runUnits[i].count; j++) {
+		instances[runUnits[i].first + j].runAdding = adding;
+	    }
+	}
+    }
 
-    /* Connect and activate plugins */
+    /* Instantiate, connect and activate plugins.  Each instance's
+     * buffers and control ports are numbered here, then the instances
+     * are set up on a pool of threads while we get on with the rest
+     * of our own setup, waiting for them only before activating JACK.
+     * Instances of a library given -L make up a single job, so are
+     * set up one after another. */
 
     for (in = 0; in < controlInsTotal; in++) {
         pluginPortUpdated[in] = 0;
@@ -1245,81 +3240,135 @@ main(int argc, char **argv)
 
     in = out = controlIn = controlOut = 0;
 
-    for (i = 0; i < instance_count; i++) {   /* i is instance number */
+    for (i = 0; i < instance_count; i++) {
         instance = &instances[i];
-
         instance->firstControlIn = controlIn;
-        for (j = 0; j < MIDI_CONTROLLER_COUNT; j++) {
-            instance->controllerMap[j] = -1;
-        }
-
-        plugin = instance->plugin;
-        for (j = 0; j < plugin->descriptor->LADSPA_Plugin->PortCount; j++) {  /* j is LADSPA port number */
-
-            LADSPA_PortDescriptor pod =
-                plugin->descriptor->LADSPA_Plugin->PortDescriptors[j];
-
-            instance->pluginPortControlInNumbers[j] = -1;
+        instance->firstControlOut = controlOut;
+        instance->firstIn = in;
+        instance->firstOut = out;
+        in += instance->plugin->ins;
+        out += instance->plugin->outs;
+        controlIn += instance->plugin->controlIns;
+        controlOut += instance->plugin->controlOuts;
+    }
 
-            if (LADSPA_IS_PORT_AUDIO(pod)) {
+    assert(in == insTotal);
+    assert(out == outsTotal);
+    assert(controlIn == controlInsTotal);
+    assert(controlOut == controlOutsTotal);
 
-                if (LADSPA_IS_PORT_INPUT(pod)) {
-                    plugin->descriptor->LADSPA_Plugin->connect_port
-                        (instanceHandles[i], j, pluginInputBuffers[in++]);
+    setupJobStarts = (int *)malloc((instance_count + 1) * sizeof(int));
+    setupOrder = (int *)malloc(instance_count * sizeof(int));
+    setupJobs = 0;
+    s = 0;
+    for (i = 0; i < instance_count; i++) {
+	if (instances[i].plugin->dll->serialSetup) continue;
+	setupJobStarts[setupJobs++] = s;
+	setupOrder[s++] = i;
+    }
+    for (dll = dlls; dll; dll = dll->next) {
+	if (!dll->serialSetup) continue;
+	setupJobStarts[setupJobs++] = s;
+	for (i = 0; i < instance_count; i++) {
+	    if (instances[i].plugin->dll == dll) setupOrder[s++] = i;
+	}
+    }
+    setupJobStarts[setupJobs] = s;
+    assert(s == instance_count);
+
+    /* we run jobs too when we come to wait for them */
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    if (cpus > setupJobs) cpus = setupJobs;
+    if (cpus > 1) {
+	setupPool = d3h_pool_new(cpus - 1, 0, setup_job, NULL);
+    }
+    if (setupPool) {
+	d3h_pool_begin(setupPool, setupJobs);
+    }
 
-                } else if (LADSPA_IS_PORT_OUTPUT(pod)) {
-                    plugin->descriptor->LADSPA_Plugin->connect_port
-                        (instanceHandles[i], j, pluginOutputBuffers[out++]);
-                }
+    build_osc_routes();
 
-            } else if (LADSPA_IS_PORT_CONTROL(pod)) {
+    /* Create OSC thread, unless we're rendering */
 
-                if (LADSPA_IS_PORT_INPUT(pod)) {
+    if (!renderFile) {
+#ifdef D3H_EPOLL
+	oscServer = lo_server_new(NULL, osc_error);
+	tmp = lo_server_get_url(oscServer);
+#else
+	serverThread = lo_server_thread_new(NULL, osc_error);
+	tmp = lo_server_thread_get_url(serverThread);
+#endif
+	snprintf((char *)osc_path_tmp, 31, "/dssi");
+	oscUrl = (char *)malloc(strlen(tmp) + strlen(osc_path_tmp));
+	sprintf(oscUrl, "%s%s", tmp, osc_path_tmp + 1);
+	if (verbose) {
+	    printf("%s: registering %s\n", myName, oscUrl);
+	}
+	free(tmp);
 
-                    if (plugin->descriptor->get_midi_controller_for_port) {
+#ifdef D3H_EPOLL
+	lo_server_add_method(oscServer, NULL, NULL, osc_message_handler, NULL);
+#else
+	lo_server_thread_add_method(serverThread, NULL, NULL, osc_message_handler,
+				    NULL);
+#endif
+    }
 
-                        int controller = plugin->descriptor->
-                            get_midi_controller_for_port(instanceHandles[i], j);
+    /* Create ALSA MIDI port */
 
-                        if (controller == 0) {
-                            MB_MESSAGE
-                                ("Buggy plugin: wants mapping for bank MSB\n");
-                        } else if (controller == 32) {
-                            MB_MESSAGE
-                                ("Buggy plugin: wants mapping for bank LSB\n");
-                        } else if (DSSI_IS_CC(controller)) {
-                            instance->controllerMap[DSSI_CC_NUMBER(controller)]
-                                = controlIn;
-                        }
-                    }
+    npfd = 0;
+    pfd = NULL;
 
-                    pluginControlInInstances[controlIn] = instance;
-                    pluginControlInPortNumbers[controlIn] = j;
-                    instance->pluginPortControlInNumbers[j] = controlIn;
+#ifdef MIDI_ALSA
+    if (!jack_midi && !renderFile) {
+	if (snd_seq_open(&alsaClient, "hw", SND_SEQ_OPEN_DUPLEX, 0) < 0) {
+	    fprintf(stderr, "\n%s: Error: Failed to open ALSA sequencer interface\n",
+		    myName);
+	    return 1;
+	}
 
-                    pluginControlIns[controlIn] = get_port_default
-                        (plugin->descriptor->LADSPA_Plugin, j);
+	snd_seq_set_client_name(alsaClient, clientName);
+
+	alsaPortIds = (int *)malloc(midiPortCount * sizeof(int));
+	for (j = 0; j < midiPortCount; j++) {
+	    char portName[48];
+	    if (midiPortCount == 1) strcpy(portName, clientName);
+	    else sprintf(portName, "%s %d", clientName, j + 1);
+	    if ((portid = snd_seq_create_simple_port
+		 (alsaClient, portName,
+		  SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE, SND_SEQ_PORT_TYPE_APPLICATION)) < 0) {
+		fprintf(stderr, "\n%s: Error: Failed to create ALSA sequencer port\n",
+			myName);
+		return 1;
+	    }
+	    alsaPortIds[j] = portid;
+	}
 
-                    plugin->descriptor->LADSPA_Plugin->connect_port
-                        (instanceHandles[i], j, &pluginControlIns[controlIn++]);
+	npfd = snd_seq_poll_descriptors_count(alsaClient, POLLIN);
+	pfd = (struct pollfd *)alloca(npfd * sizeof(struct pollfd));
+	snd_seq_poll_descriptors(alsaClient, pfd, npfd, POLLIN);
+    }
+#endif /* MIDI_ALSA */
 
-                } else if (LADSPA_IS_PORT_OUTPUT(pod)) {
-                    plugin->descriptor->LADSPA_Plugin->connect_port
-                        (instanceHandles[i], j, &pluginControlOuts[controlOut++]);
-                }
-            }
-        }  /* 'for (j...'  LADSPA port number */
+    /* Wait for the instances to be set up */
 
-        if (plugin->descriptor->LADSPA_Plugin->activate) {
-            plugin->descriptor->LADSPA_Plugin->activate(instanceHandles[i]);
-        }
-	instance->inactive = 0;
-    } /* 'for (i...' instance number */
+    if (setupPool) {
+	d3h_pool_wait(setupPool);
+	d3h_pool_free(setupPool);
+    } else {
+	for (i = 0; i < setupJobs; i++) {
+	    setup_job(i, NULL);
+	}
+    }
+    free(setupJobStarts);
+    free(setupOrder);
+    if (setupFailed) {
+	return 1;
+    }
 
-    assert(in == insTotal);
-    assert(out == outsTotal);
-    assert(controlIn == controlInsTotal);
-    assert(controlOut == controlOutsTotal);
+    for (plugin = plugins; plugin; plugin = plugin->next) {
+        build_controller_tables(plugin);
+    }
 
     /* Look up synth programs */
 
@@ -1340,32 +3389,28 @@ main(int argc, char **argv)
         }
     }
 
-    /* Create ALSA MIDI port */
-
-#ifdef MIDI_ALSA
-    if (snd_seq_open(&alsaClient, "hw", SND_SEQ_OPEN_DUPLEX, 0) < 0) {
-	fprintf(stderr, "\n%s: Error: Failed to open ALSA sequencer interface\n",
-		myName);
-	return 1;
-    }
-
-    snd_seq_set_client_name(alsaClient, clientName);
-
-    if ((portid = snd_seq_create_simple_port
-	 (alsaClient, clientName,
-	  SND_SEQ_PORT_CAP_WRITE | SND_SEQ_PORT_CAP_SUBS_WRITE, SND_SEQ_PORT_TYPE_APPLICATION)) < 0) {
-	fprintf(stderr, "\n%s: Error: Failed to create ALSA sequencer port\n",
-		myName);
-	return 1;
+    if (renderFile) {
+	/* nothing to clean up after that matters, so let signals
+	   simply stop us */
+	pthread_sigmask(SIG_UNBLOCK, &_signals, 0);
+	i = render(renderFile, renderEvents, renderEventCount, bufferSize);
+	if (workerPool) {
+	    d3h_pool_free(workerPool);
+	}
+	deactivate_instances();
+	return i;
     }
 
-    npfd = snd_seq_poll_descriptors_count(alsaClient, POLLIN);
-    pfd = (struct pollfd *)alloca(npfd * sizeof(struct pollfd));
-    snd_seq_poll_descriptors(alsaClient, pfd, npfd, POLLIN);
-#endif /* MIDI_ALSA */
+#ifndef D3H_EPOLL
+    lo_server_thread_start(serverThread);
+#endif
 
     mb_init("host: ");
 
+#ifdef D3H_EPOLL
+    mainLoopWakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#endif
+
     /* activate JACK and connect ports */
     if (jack_activate(jackClient)) {
         fprintf (stderr, "cannot activate jack client");
@@ -1378,7 +3423,7 @@ main(int argc, char **argv)
                                "^" JACK_DEFAULT_AUDIO_TYPE "$",
                                JackPortIsPhysical|JackPortIsInput);
         if (ports && ports[0]) {
-            for (i = 0, j = 0; i < outsTotal; ++i) {
+            for (i = 0, j = 0; i < outputPortCount; ++i) {
                 if (jack_connect(jackClient, jack_port_name(outputPorts[i]),
                                  ports[j])) {
                     fprintf (stderr, "cannot connect output port %d\n", i);
@@ -1389,64 +3434,192 @@ main(int argc, char **argv)
         }
     }
 
+#ifdef D3H_EPOLL
+    /* leave the signals blocked, for the main loop to read */
+    sigemptyset(&waitSignals);
+    sigaddset(&waitSignals, SIGINT);
+    sigaddset(&waitSignals, SIGTERM);
+    sigaddset(&waitSignals, SIGHUP);
+    sigaddset(&waitSignals, SIGQUIT);
+    sigaddset(&waitSignals, SIGCHLD);
+    signalFd = signalfd(-1, &waitSignals, SFD_NONBLOCK | SFD_CLOEXEC);
+#else
     signal(SIGINT, signalHandler);
     signal(SIGTERM, signalHandler);
     signal(SIGHUP, signalHandler);
     signal(SIGQUIT, signalHandler);
+    signal(SIGCHLD, childHandler);
     pthread_sigmask(SIG_UNBLOCK, &_signals, 0);
+#endif
 
     /* Attempt to locate and start up a GUI for the plugin -- but
-     * continue even if we can't */
-    /* -FIX- Ack! So many windows all at once! */
+     * continue even if we can't.  Without -n, every instance gets
+     * one now; otherwise a GUI is only started when an OSC show
+     * message is sent to its instance's URL. */
     if (load_guis) {
         for (i = 0; i < instance_count; i++) {
-            char tag[12];
-            plugin = instances[i].plugin;
-            snprintf(osc_path_tmp, 1024, "%s/%s", url, instances[i].friendly_name);
-            snprintf(tag, 12, "channel %d", instances[i].channel);
-            printf("\n%s: OSC URL is:\n%s\n\n", myName, osc_path_tmp);
+            printf("\n%s: OSC URL is:\n%s/%s\n\n", myName, oscUrl,
+                   instances[i].friendly_name);
 	    fflush(stdout);
-            startGUI(plugin->dll->directory, plugin->dll->name,
-                    plugin->descriptor->LADSPA_Plugin->Label, osc_path_tmp, tag);
+            pthread_mutex_lock(&uiSendMutex);
+            start_gui(&instances[i]);
+            pthread_mutex_unlock(&uiSendMutex);
         }
     }
 
     MB_MESSAGE("Ready\n");
 
+#ifdef D3H_EPOLL
+    epollFd = epoll_create(D3H_WAIT_EVENTS);
+    if (epollFd < 0 || mainLoopWakeFd < 0 || signalFd < 0) {
+	fprintf(stderr, "%s: Error: failed to set up the main loop\n", myName);
+	return 1;
+    }
+    waitEvent.events = EPOLLIN;
+    for (i = 0; i < npfd; i++) {
+	waitEvent.data.u32 = D3H_WAIT_ALSA;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, pfd[i].fd, &waitEvent);
+    }
+    waitEvent.data.u32 = D3H_WAIT_OSC;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, lo_server_get_socket_fd(oscServer), &waitEvent);
+    waitEvent.data.u32 = D3H_WAIT_AUDIO;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, mainLoopWakeFd, &waitEvent);
+    waitEvent.data.u32 = D3H_WAIT_SIGNAL;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, signalFd, &waitEvent);
+#endif
+
     exiting = 0;
 
     while (!exiting) {
 
+#ifdef D3H_EPOLL
+	timeout = -1;
+	if (__atomic_load_n(&uiSendPending, __ATOMIC_ACQUIRE)) {
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    nowMs = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	    timeout = (nextUiSendMs > nowMs ? (int)(nextUiSendMs - nowMs) : 0);
+	}
+	nready = epoll_wait(epollFd, readyEvents, D3H_WAIT_EVENTS, timeout);
+	alsaReady = 0;
+	for (k = 0; k < nready; k++) {
+	    switch (readyEvents[k].data.u32) {
+	    case D3H_WAIT_ALSA:
+		alsaReady = 1;
+		break;
+	    case D3H_WAIT_OSC:
+		while (lo_server_recv_noblock(oscServer, 0) > 0);
+		break;
+	    case D3H_WAIT_AUDIO:
+		if (read(mainLoopWakeFd, &wakes, sizeof(wakes)) < 0) {
+		    /* already read */
+		}
+		break;
+	    case D3H_WAIT_SIGNAL:
+		while (read(signalFd, &signalInfo, sizeof(signalInfo)) ==
+		       sizeof(signalInfo)) {
+		    if (signalInfo.ssi_signo == SIGCHLD) {
+			childHandler(SIGCHLD);
+		    } else {
+			signalHandler(signalInfo.ssi_signo);
+		    }
+		}
+		break;
+	    }
+	}
+	if (alsaReady) {
+	    midi_callback();
+	}
+#else
 #ifdef MIDI_ALSA
 	if (poll(pfd, npfd, 100) > 0) {
 	    midi_callback();
 	}
 #endif /* MIDI_ALSA */
+#endif /* D3H_EPOLL */
 
-	/* Race conditions here, because the programs and ports are
-	   updated from the audio thread.  We at least try to minimise
-	   trouble by copying out before the expensive OSC call */
+	if (guisExited) {
+	    guisExited = 0;
+	    reap_guis();
+	}
 
-        for (i = 0; i < instance_count; i++) {
-            instance = &instances[i];
-            if (instance->uiNeedsProgramUpdate && instance->pendingProgramChange < 0) {
-                int bank = instance->currentBank;
-                int program = instance->currentProgram;
-                instance->uiNeedsProgramUpdate = 0;
-                if (instance->uiTarget) {
-                    lo_send(instance->uiTarget, instance->ui_osc_program_path, "ii", bank, program);
-                }
-            }
-        }
+	for (i = 0; i < D3H_PRODUCER_COUNT; i++) {
+	    unsigned long dropped = 0;
+	    for (j = 0; j < instance_count; j++) {
+		dropped += d3h_event_ring_dropped(&midiEventRings[i][j]);
+	    }
+	    if (dropped != midiEventsDropped[i]) {
+		fprintf(stderr, "%s: Warning: MIDI event buffer overflow! ignored %lu %s event(s)\n",
+			myName, dropped - midiEventsDropped[i],
+			i == D3H_PRODUCER_ALSA ? "ALSA" : "OSC");
+		midiEventsDropped[i] = dropped;
+	    }
+	}
+	if (jackMidiEventsDropped != jackMidiEventsReported) {
+	    unsigned long dropped = jackMidiEventsDropped;
+	    fprintf(stderr, "%s: Warning: MIDI event buffer overflow! ignored %lu JACK event(s)\n",
+		    myName, dropped - jackMidiEventsReported);
+	    jackMidiEventsReported = dropped;
+	}
+	for (i = 0; i < instance_count; i++) {
+	    unsigned long shed = eventsShed[i];
+	    unsigned long deferred = eventsDeferred[i];
+	    if (shed != eventsShedReported[i]) {
+		fprintf(stderr, "%s: Warning: %s: dropped %lu controller event(s) to make room for notes\n",
+			myName, instances[i].friendly_name, shed - eventsShedReported[i]);
+		eventsShedReported[i] = shed;
+	    }
+	    if (deferred != eventsDeferredReported[i]) {
+		if (verbose) {
+		    fprintf(stderr, "%s: %s: event buffer full, %lu event(s) held over to the next cycle\n",
+			    myName, instances[i].friendly_name, deferred - eventsDeferredReported[i]);
+		}
+		eventsDeferredReported[i] = deferred;
+	    }
+	}
+
+	/* Pass changes on to the UIs.  Clearing the queued flag before
+	   reading the value means that a change made after we read it
+	   gets queued again. */
+
+	pthread_mutex_lock(&uiSendMutex);
+	for (i = 0; i < instance_count; i++) {
+	    instance = &instances[i];
+	    while ((ev = d3h_event_ring_peek(&uiChangeRings[i]))) {
+		if (ev->type == D3H_EVENT_PROGRAM) {
+		    __atomic_store_n(&instance->uiProgramQueued, 0, __ATOMIC_SEQ_CST);
+		    d3h_event_ring_advance(&uiChangeRings[i]);
+		    ui_note_program(instance, instance->currentBank,
+				    instance->currentProgram);
+		} else {
+		    long in = ev->data.raw32.d[0];
+		    float value;
+		    __atomic_store_n(&pluginPortUpdated[in], 0, __ATOMIC_SEQ_CST);
+		    __atomic_load(&pluginControlIns[in], &value, __ATOMIC_SEQ_CST);
+		    d3h_event_ring_advance(&uiChangeRings[i]);
+		    ui_note_control(instance, in, value);
+		}
+	    }
+	}
+	pthread_mutex_unlock(&uiSendMutex);
+
+	if (__atomic_load_n(&uiSendPending, __ATOMIC_ACQUIRE)) {
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    nowMs = (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+	    if (nowMs >= nextUiSendMs) {
+		ui_send(nowMs);
+		nextUiSendMs = nowMs + UI_SEND_INTERVAL_MS;
+	    }
+	}
 
-	for (i = 0; i < controlInsTotal; ++i) {
-	    if (pluginPortUpdated[i]) {
-		int port = pluginControlInPortNumbers[i];
-		float value = pluginControlIns[i];
-                instance = pluginControlInInstances[i];
-		pluginPortUpdated[i] = 0;
-		if (instance->uiTarget) {
-		    lo_send(instance->uiTarget, instance->ui_osc_control_path, "if", port, value);
+	if (verbose) {
+	    for (i = 0; i < instance_count; i++) {
+		unsigned long suppressed = __atomic_load_n(&instances[i].uiUpdatesSuppressed,
+							   __ATOMIC_RELAXED);
+		if (suppressed != uiUpdatesSuppressedReported[i]) {
+		    fprintf(stderr, "%s: %s: %lu UI update(s) superseded before they were sent\n",
+			    myName, instances[i].friendly_name,
+			    suppressed - uiUpdatesSuppressedReported[i]);
+		    uiUpdatesSuppressedReported[i] = suppressed;
 		}
 	    }
 	}
@@ -1454,6 +3627,10 @@ main(int argc, char **argv)
 
     jack_client_close(jackClient);
 
+    if (workerPool) {
+	d3h_pool_free(workerPool);
+    }
+
     /* cleanup plugins */
     for (i = 0; i < instance_count; i++) {
         instance = &instances[i];
@@ -1468,17 +3645,8 @@ main(int argc, char **argv)
             lo_address_free(instance->uiSource);
             instance->uiSource = NULL;
         }
-
-        if (instance->plugin->descriptor->LADSPA_Plugin->deactivate) {
-            instance->plugin->descriptor->LADSPA_Plugin->deactivate
-		(instanceHandles[i]);
-	}
-
-        if (instance->plugin->descriptor->LADSPA_Plugin->cleanup) {
-            instance->plugin->descriptor->LADSPA_Plugin->cleanup
-		(instanceHandles[i]);
-	}
     }
+    deactivate_instances();
 
     sleep(1);
     sigemptyset (&_signals);
@@ -1606,13 +3774,7 @@ osc_midi_handler(d3h_instance_t *instance, lo_arg **argv)
         ev->type =  SND_SEQ_EVENT_NOTEOFF;
     }
         
-    pthread_mutex_lock(&midiEventBufferMutex);
-
-    if (midiEventReadIndex == midiEventWriteIndex + 1) {
-
-        fprintf(stderr, "%s: Warning: MIDI event buffer overflow!\n", myName);
-
-    } else if (ev->type == SND_SEQ_EVENT_CONTROLLER &&
+    if (ev->type == SND_SEQ_EVENT_CONTROLLER &&
                (ev->data.control.param == 0 || ev->data.control.param == 32)) {
 
         fprintf(stderr, "%s: Warning: %s UI sent bank select controller (should use /program OSC call), ignoring\n", myName, instance->friendly_name);
@@ -1623,13 +3785,14 @@ osc_midi_handler(d3h_instance_t *instance, lo_arg **argv)
 
     } else {
 
-        midiEventBuffer[midiEventWriteIndex] = *ev;
-        midiEventWriteIndex = (midiEventWriteIndex + 1) % EVENT_BUFFER_SIZE;
-
+        /* overflow is counted by the ring and reported from the main
+           loop */
+        stamp_event(ev);
+        if (classify_event(D3H_PRODUCER_OSC, instance->midiPort, ev)) {
+            queue_event(D3H_PRODUCER_OSC, instance, ev);
+        }
     }
 
-    pthread_mutex_unlock(&midiEventBufferMutex);
-
     return 0;
 }
 
@@ -1638,6 +3801,7 @@ osc_control_handler(d3h_instance_t *instance, lo_arg **argv)
 {
     int port = argv[0]->i;
     LADSPA_Data value = argv[1]->f;
+    snd_seq_event_t ev;
 
     if (port < 0 || port > instance->plugin->descriptor->LADSPA_Plugin->PortCount) {
 	fprintf(stderr, "%s: OSC: %s port number (%d) is out of range\n",
@@ -1649,7 +3813,15 @@ osc_control_handler(d3h_instance_t *instance, lo_arg **argv)
                 myName, instance->friendly_name, port);
 	return 0;
     }
-    pluginControlIns[instance->pluginPortControlInNumbers[port]] = value;
+    /* applied by the audio thread, at the start of a period (or with
+       -s, at the frame it arrived a period ago), so that the plugin
+       never sees a port change during a run */
+    memset(&ev, 0, sizeof(ev));
+    ev.type = D3H_EVENT_UI_CONTROL;
+    ev.data.raw32.d[0] = instance->pluginPortControlInNumbers[port];
+    memcpy(&ev.data.raw32.d[1], &value, sizeof(float));
+    stamp_event(&ev);
+    queue_event(D3H_PRODUCER_OSC, instance, &ev);
     if (verbose) {
 	printf("%s: OSC: %s port %d = %f\n",
 	       myName, instance->friendly_name, port, value);
@@ -1665,6 +3837,7 @@ osc_program_handler(d3h_instance_t *instance, lo_arg **argv)
     int program = argv[1]->i;
     int i;
     int found = 0;
+    snd_seq_event_t ev;
 
     for (i = 0; i < instance->pluginProgramCount; ++i) {
 	if (instance->pluginPrograms[i].Bank == bank &&
@@ -1685,9 +3858,14 @@ osc_program_handler(d3h_instance_t *instance, lo_arg **argv)
 	       myName, instance->friendly_name, bank, program);
     }
 
-    instance->pendingBankMSB = bank / 128;
-    instance->pendingBankLSB = bank % 128;
-    instance->pendingProgramChange = program;
+    /* the bank and program go to the audio thread together */
+    memset(&ev, 0, sizeof(ev));
+    ev.type = D3H_EVENT_UI_PROGRAM;
+    ev.data.raw32.d[0] = bank / 128;
+    ev.data.raw32.d[1] = bank % 128;
+    ev.data.raw32.d[2] = program;
+    stamp_event(&ev);
+    queue_event(D3H_PRODUCER_OSC, instance, &ev);
 
     return 0;
 }
@@ -1741,9 +3919,10 @@ osc_configure_handler(d3h_instance_t *instance, lo_arg **argv)
 
 	    // also call back on UIs for plugins other than the one
 	    // that requested this:
-	    if (n != instance->number && instances[n].uiTarget) {
-		lo_send(instances[n].uiTarget,
-			instances[n].ui_osc_configure_path, "ss", key, value);
+	    if (n != instance->number) {
+		pthread_mutex_lock(&uiSendMutex);
+		ui_note_configure(&instances[n], key, value);
+		pthread_mutex_unlock(&uiSendMutex);
 	    }
 		
 	    /* configure invalidates bank and program information, so
@@ -1770,6 +3949,15 @@ osc_update_handler(d3h_instance_t *instance, lo_arg **argv, lo_address source)
 	printf("%s: OSC: got update request from <%s>\n", myName, url);
     }
 
+    pthread_mutex_lock(&uiSendMutex);
+
+    /* anything still waiting was for the UI's previous incarnation,
+       and the new one starts with a full allowance */
+    ui_forget(instance);
+    instance->uiMessageAllowance = UI_BURST_MESSAGES;
+    instance->uiByteAllowance = UI_BURST_BYTES;
+    instance->uiAllowanceTime = 0;
+
     if (instance->uiTarget) lo_address_free(instance->uiTarget);
     host = lo_url_get_hostname(url);
     port = lo_url_get_port(url);
@@ -1781,6 +3969,7 @@ osc_update_handler(d3h_instance_t *instance, lo_arg **argv, lo_address source)
     chost = lo_address_get_hostname(source);
     cport = lo_address_get_port(source);
     instance->uiSource = lo_address_new(chost, cport);
+    instance->uiSourceKey = osc_source_key(source);
 
     path = lo_url_get_path(url);
 
@@ -1827,31 +4016,234 @@ osc_update_handler(d3h_instance_t *instance, lo_arg **argv, lo_address source)
 
     /* Send current bank/program  (-FIX- another race...) */
     if (instance->pendingProgramChange < 0) {
-        unsigned long bank = instance->currentBank;
-        unsigned long program = instance->currentProgram;
-        instance->uiNeedsProgramUpdate = 0;
-        if (instance->uiTarget) {
-            lo_send(instance->uiTarget, instance->ui_osc_program_path, "ii", bank, program);
-        }
+        ui_note_program(instance, instance->currentBank, instance->currentProgram);
     }
 
-    /* Send control ports */
+    /* Send control ports, and then 'show'.  These go out a bundle at
+     * a time from the main loop, so as not to hold up OSC handling or
+     * flood the UI when there are lots and lots of ports */
     for (i = 0; i < instance->plugin->controlIns; i++) {
         int in = i + instance->firstControlIn;
-	int port = pluginControlInPortNumbers[in];
-	lo_send(instance->uiTarget, instance->ui_osc_control_path, "if", port,
-                pluginControlIns[in]);
-	/* Avoid overloading the GUI if there are lots and lots of ports */
-	if ((i+1) % 50 == 0) usleep(300000);
+	float value;
+	__atomic_load(&pluginControlIns[in], &value, __ATOMIC_SEQ_CST);
+	ui_note_control(instance, in, value);
+    }
+    instance->uiShowPending = !instance->ui_initial_show_sent;
+
+    pthread_mutex_unlock(&uiSendMutex);
+
+    return 0;
+}
+
+/* The ui_note_*() functions are called with uiSendMutex held.  Each
+ * replaces anything of the same kind still waiting to be sent. */
+
+static void
+ui_note_control(d3h_instance_t *instance, int in, float value)
+{
+    if (!instance->uiTarget) return;
+
+    uiControlValues[in] = value;
+    if (uiControlDirty[in]) {
+	__atomic_store_n(&instance->uiUpdatesSuppressed,
+			 instance->uiUpdatesSuppressed + 1, __ATOMIC_RELAXED);
+	return;
+    }
+    uiControlDirty[in] = 1;
+    instance->uiDirtyControls[instance->uiDirtyCount++] = in;
+    __atomic_store_n(&uiSendPending, 1, __ATOMIC_RELEASE);
+}
+
+static void
+ui_note_program(d3h_instance_t *instance, long bank, long program)
+{
+    if (!instance->uiTarget) return;
+
+    if (instance->uiProgramDirty) {
+	__atomic_store_n(&instance->uiUpdatesSuppressed,
+			 instance->uiUpdatesSuppressed + 1, __ATOMIC_RELAXED);
+    }
+    instance->uiBank = bank;
+    instance->uiProgram = program;
+    instance->uiProgramDirty = 1;
+    __atomic_store_n(&uiSendPending, 1, __ATOMIC_RELEASE);
+}
+
+static void
+ui_note_configure(d3h_instance_t *instance, const char *key, const char *value)
+{
+    d3h_ui_configure_t **c;
+
+    if (!instance->uiTarget) return;
+
+    for (c = &instance->uiConfigures; *c; c = &(*c)->next) {
+	if (!strcmp((*c)->key, key)) break;
+    }
+    if (*c) {
+	__atomic_store_n(&instance->uiUpdatesSuppressed,
+			 instance->uiUpdatesSuppressed + 1, __ATOMIC_RELAXED);
+	free((*c)->value);
+    } else {
+	*c = (d3h_ui_configure_t *)calloc(1, sizeof(d3h_ui_configure_t));
+	(*c)->key = strdup(key);
+    }
+    (*c)->value = strdup(value);
+    __atomic_store_n(&uiSendPending, 1, __ATOMIC_RELEASE);
+}
+
+/* Discards everything waiting to be sent to the instance's UI */
+static void
+ui_forget(d3h_instance_t *instance)
+{
+    d3h_ui_configure_t *c;
+    int i;
+
+    for (i = 0; i < instance->uiDirtyCount; i++) {
+	uiControlDirty[instance->uiDirtyControls[i]] = 0;
+    }
+    instance->uiDirtyCount = 0;
+    instance->uiProgramDirty = 0;
+    instance->uiShowPending = 0;
+    while ((c = instance->uiConfigures)) {
+	instance->uiConfigures = c->next;
+	free(c->key);
+	free(c->value);
+	free(c);
+    }
+}
+
+static void
+ui_send_bundle(d3h_instance_t *instance, lo_bundle *bundle)
+{
+    if (*bundle) {
+	lo_send_bundle(instance->uiTarget, *bundle);
+	lo_bundle_free_messages(*bundle);
+	*bundle = NULL;
+    }
+}
+
+/* Adds a message to the bundle for the instance's UI, sending the
+ * bundle first if the message would overflow it.  Returns 0, having
+ * freed the message, if the UI's allowance won't stretch to it.  (A
+ * message bigger than the most that can be saved up goes once the
+ * allowance is full.) */
+static int
+ui_bundle_message(d3h_instance_t *instance, lo_bundle *bundle, size_t *size,
+		  const char *path, lo_message message)
+{
+    size_t length = lo_message_length(message, path) + 4;
+
+    if (instance->uiMessageAllowance < 1 ||
+	(instance->uiByteAllowance < length &&
+	 instance->uiByteAllowance < UI_BURST_BYTES)) {
+	lo_message_free(message);
+	return 0;
+    }
+    if (*bundle && *size + length > UI_BUNDLE_BYTES) {
+	ui_send_bundle(instance, bundle);
+    }
+    if (!*bundle) {
+	*bundle = lo_bundle_new(LO_TT_IMMEDIATE);
+	*size = 16;  /* "#bundle" and the time tag */
+    }
+    lo_bundle_add_message(*bundle, path, message);
+    *size += length;
+    instance->uiMessageAllowance -= 1;
+    instance->uiByteAllowance -= length;
+    return 1;
+}
+
+/* Sends what it can of what is waiting for one UI.  Configure calls
+ * go first, as they may change the meaning of the rest, then the
+ * program, then the controls and 'show'.  Returns nonzero if there is
+ * more to send. */
+static int
+ui_send_instance(d3h_instance_t *instance, long long now)
+{
+    lo_bundle bundle = NULL;
+    lo_message message;
+    d3h_ui_configure_t *c;
+    size_t size = 0;
+    double elapsed = (double)(now - instance->uiAllowanceTime) / 1000.0;
+    int i, in, sent = 0, more = 1;
+
+    instance->uiAllowanceTime = now;
+    instance->uiMessageAllowance += UI_MAX_MESSAGES * elapsed;
+    if (instance->uiMessageAllowance > UI_BURST_MESSAGES) {
+	instance->uiMessageAllowance = UI_BURST_MESSAGES;
+    }
+    instance->uiByteAllowance += UI_MAX_BYTES * elapsed;
+    if (instance->uiByteAllowance > UI_BURST_BYTES) {
+	instance->uiByteAllowance = UI_BURST_BYTES;
+    }
+
+    while ((c = instance->uiConfigures)) {
+	message = lo_message_new();
+	lo_message_add_string(message, c->key);
+	lo_message_add_string(message, c->value);
+	if (!ui_bundle_message(instance, &bundle, &size,
+			       instance->ui_osc_configure_path, message)) goto done;
+	instance->uiConfigures = c->next;
+	free(c->key);
+	free(c->value);
+	free(c);
+    }
+
+    if (instance->uiProgramDirty) {
+	message = lo_message_new();
+	lo_message_add_int32(message, instance->uiBank);
+	lo_message_add_int32(message, instance->uiProgram);
+	if (!ui_bundle_message(instance, &bundle, &size,
+			       instance->ui_osc_program_path, message)) goto done;
+	instance->uiProgramDirty = 0;
+    }
+
+    for (; sent < instance->uiDirtyCount; sent++) {
+	in = instance->uiDirtyControls[sent];
+	message = lo_message_new();
+	lo_message_add_int32(message, pluginControlInPortNumbers[in]);
+	lo_message_add_float(message, uiControlValues[in]);
+	if (!ui_bundle_message(instance, &bundle, &size,
+			       instance->ui_osc_control_path, message)) goto done;
+	uiControlDirty[in] = 0;
     }
 
-    /* Send 'show' */
-    if (!instance->ui_initial_show_sent) {
-	lo_send(instance->uiTarget, instance->ui_osc_show_path, "");
+    if (instance->uiShowPending) {
+	message = lo_message_new();
+	if (!ui_bundle_message(instance, &bundle, &size,
+			       instance->ui_osc_show_path, message)) goto done;
+	instance->uiShowPending = 0;
 	instance->ui_initial_show_sent = 1;
     }
+    more = 0;
+
+ done:
+    ui_send_bundle(instance, &bundle);
+    if (sent > 0) {
+	instance->uiDirtyCount -= sent;
+	for (i = 0; i < instance->uiDirtyCount; i++) {
+	    instance->uiDirtyControls[i] = instance->uiDirtyControls[i + sent];
+	}
+    }
+    return more;
+}
+
+/* Called by the main loop */
+static int
+ui_send(long long now)
+{
+    int i, more = 0;
+
+    pthread_mutex_lock(&uiSendMutex);
+    for (i = 0; i < instance_count; i++) {
+	if (instances[i].uiTarget && ui_send_instance(&instances[i], now)) {
+	    more = 1;
+	}
+    }
+    __atomic_store_n(&uiSendPending, more, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&uiSendMutex);
 
-    return 0;
+    return more;
 }
 
 int
@@ -1864,10 +4256,13 @@ osc_exiting_handler(d3h_instance_t *instance, lo_arg **argv)
 	       instance->number);
     }
 
+    pthread_mutex_lock(&uiSendMutex);
+    ui_forget(instance);
     if (instance->uiTarget) {
         lo_address_free(instance->uiTarget);
         instance->uiTarget = NULL;
     }
+    pthread_mutex_unlock(&uiSendMutex);
 
     if (instance->uiSource) {
         lo_address_free(instance->uiSource);
@@ -1902,6 +4297,27 @@ osc_exiting_handler(d3h_instance_t *instance, lo_arg **argv)
     return 0;
 }
 
+/* Asks for the instance's GUI to be shown, starting it if need be */
+int
+osc_show_handler(d3h_instance_t *instance)
+{
+    if (verbose) {
+	printf("%s: OSC: got show request for instance %d\n", myName,
+	       instance->number);
+    }
+
+    pthread_mutex_lock(&uiSendMutex);
+    if (instance->uiTarget) {
+	instance->uiShowPending = 1;
+	__atomic_store_n(&uiSendPending, 1, __ATOMIC_RELEASE);
+    } else {
+	start_gui(instance);
+    }
+    pthread_mutex_unlock(&uiSendMutex);
+
+    return 0;
+}
+
 int osc_debug_handler(const char *path, const char *types, lo_arg **argv,
                       int argc, void *data, void *user_data)
 {
@@ -1918,93 +4334,176 @@ int osc_debug_handler(const char *path, const char *types, lo_arg **argv,
     return 1;
 }
 
+static unsigned long
+hash_string(const char *s, unsigned long hash)
+{
+    /* FNV-1a */
+    while (*s) {
+	hash = ((hash ^ (unsigned char)*s++) * 16777619UL) & 0xffffffffUL;
+    }
+    return hash;
+}
+
+/* Builds the table of every instance's OSC method paths, once the
+ * instances have their names */
+static void
+build_osc_routes(void)
+{
+    unsigned long size, hash, j;
+    char *path;
+    int i, m;
+
+    for (size = 1; size < 2 * instance_count * D3H_OSC_METHOD_COUNT; size <<= 1);
+    oscRoutes = (d3h_osc_route_t *)calloc(size, sizeof(d3h_osc_route_t));
+    oscRouteMask = size - 1;
+
+    for (i = 0; i < instance_count; i++) {
+	for (m = 0; m < D3H_OSC_METHOD_COUNT; m++) {
+	    path = (char *)malloc(strlen(instances[i].friendly_name) +
+				  strlen(oscMethodNames[m]) + 8);
+	    sprintf(path, "/dssi/%s/%s", instances[i].friendly_name,
+		    oscMethodNames[m]);
+	    hash = hash_string(path, D3H_HASH_SEED);
+	    for (j = hash & oscRouteMask; oscRoutes[j].path; j = (j + 1) & oscRouteMask);
+	    oscRoutes[j].path = path;
+	    oscRoutes[j].hash = hash;
+	    oscRoutes[j].instance = &instances[i];
+	    oscRoutes[j].method = m;
+	}
+    }
+}
+
+static d3h_osc_route_t *
+find_osc_route(const char *path)
+{
+    unsigned long hash = hash_string(path, D3H_HASH_SEED), j;
+
+    for (j = hash & oscRouteMask; oscRoutes[j].path; j = (j + 1) & oscRouteMask) {
+	if (oscRoutes[j].hash == hash && !strcmp(oscRoutes[j].path, path)) {
+	    return &oscRoutes[j];
+	}
+    }
+    return NULL;
+}
+
+/* A numeric key for the address an OSC message came from: its port
+ * in the bottom 16 bits, above the IPv4 address it came from, or the
+ * IPv6 address (or, for any other kind, the host name) folded into
+ * the remaining 48.  A UI's key is taken once, at /update. */
+static unsigned long long
+osc_source_key(lo_address source)
+{
+    const char *host = lo_address_get_hostname(source);
+    const char *port = lo_address_get_port(source);
+    unsigned long long address = 0;
+    struct in_addr address4;
+    struct in6_addr address6;
+    int i;
+
+    if (host && inet_pton(AF_INET, host, &address4) == 1) {
+	address = ntohl(address4.s_addr);
+    } else if (host && inet_pton(AF_INET6, host, &address6) == 1) {
+	for (i = 0; i < 16; i++) {
+	    address = (address * 257) ^ address6.s6_addr[i];
+	}
+    } else if (host) {
+	address = hash_string(host, D3H_HASH_SEED);
+    }
+
+    return (address << 16) ^ (port ? strtoul(port, NULL, 10) & 0xffff : 0);
+}
+
+/* Returns true if an instance has a UI and source isn't it, so that
+ * the UI should hear about a change the message makes.  Only the
+ * methods that echo to the UI ask. */
+static int
+from_other_source(d3h_instance_t *instance, lo_address source)
+{
+    if (!instance->uiSource || !instance->uiTarget) return 0;
+
+    return osc_source_key(source) != instance->uiSourceKey;
+}
+
 int osc_message_handler(const char *path, const char *types, lo_arg **argv,
                         int argc, void *data, void *user_data)
 {
-    int i;
-    d3h_instance_t *instance = NULL;
-    const char *method;
-    unsigned int flen = 0;
+    d3h_osc_route_t *route;
+    d3h_instance_t *instance;
     lo_message message;
     lo_address source;
-    int send_to_ui = 0;
 
-    if (strncmp(path, "/dssi/", 6))
+    if (!(route = find_osc_route(path)))
         return osc_debug_handler(path, types, argv, argc, data, user_data);
 
-    for (i = 0; i < instance_count; i++) {
-	flen = strlen(instances[i].friendly_name);
-        if (!strncmp(path + 6, instances[i].friendly_name, flen) &&
-	    *(path + 6 + flen) == '/') { /* avoid matching prefix only */
-            instance = &instances[i];
-            break;
-        }
-    }
-    if (!instance)
-        return osc_debug_handler(path, types, argv, argc, data, user_data);
+    instance = route->instance;
 
     /* no -- see comment in osc_exiting_handler */
     /*
     if (instance->inactive) 
 	return 0;
     */
-    method = path + 6 + flen;
-    if (*method != '/' || *(method + 1) == 0)
-        return osc_debug_handler(path, types, argv, argc, data, user_data);
-    method++;
 
     message = (lo_message)data;
     source = lo_message_get_source(message);
 
-    if (instance->uiSource && instance->uiTarget) {
-	if (strcmp(lo_address_get_hostname(source),
-		   lo_address_get_hostname(instance->uiSource)) ||
-	    strcmp(lo_address_get_port(source),
-		   lo_address_get_port(instance->uiSource))) {
-	    /* This didn't come from our known UI for this plugin,
-	       so send an update to that as well */
-	    send_to_ui = 1;
-	}
-    }
+    switch (route->method) {
 
-    if (!strcmp(method, "configure") && argc == 2 && !strcmp(types, "ss")) {
+    case D3H_OSC_CONFIGURE:
+	if (argc != 2 || strcmp(types, "ss")) break;
 
-	if (send_to_ui) {
-	    lo_send(instance->uiTarget, instance->ui_osc_configure_path, "ss",
-		    &argv[0]->s, &argv[1]->s);
+	if (from_other_source(instance, source)) {
+	    pthread_mutex_lock(&uiSendMutex);
+	    ui_note_configure(instance, &argv[0]->s, &argv[1]->s);
+	    pthread_mutex_unlock(&uiSendMutex);
 	}
 
         return osc_configure_handler(instance, argv);
 
-    } else if (!strcmp(method, "control") && argc == 2 && !strcmp(types, "if")) {
-
-	if (send_to_ui) {
-	    lo_send(instance->uiTarget, instance->ui_osc_control_path, "if",
-		    argv[0]->i, argv[1]->f);
+    case D3H_OSC_CONTROL:
+	if (argc != 2 || strcmp(types, "if")) break;
+
+	if (argv[0]->i >= 0 &&
+	    argv[0]->i < instance->plugin->descriptor->LADSPA_Plugin->PortCount &&
+	    instance->pluginPortControlInNumbers[argv[0]->i] >= 0 &&
+	    from_other_source(instance, source)) {
+	    pthread_mutex_lock(&uiSendMutex);
+	    ui_note_control(instance, instance->pluginPortControlInNumbers[argv[0]->i],
+			    argv[1]->f);
+	    pthread_mutex_unlock(&uiSendMutex);
 	}
 
         return osc_control_handler(instance, argv);
 
-    } else if (!strcmp(method, "midi") && argc == 1 && !strcmp(types, "m")) {
+    case D3H_OSC_MIDI:
+	if (argc != 1 || strcmp(types, "m")) break;
 
         return osc_midi_handler(instance, argv);
 
-    } else if (!strcmp(method, "program") && argc == 2 && !strcmp(types, "ii")) {
+    case D3H_OSC_PROGRAM:
+	if (argc != 2 || strcmp(types, "ii")) break;
 
-	if (send_to_ui) {
-	    lo_send(instance->uiTarget, instance->ui_osc_program_path, "ii",
-		    argv[0]->i, argv[1]->i);
+	if (from_other_source(instance, source)) {
+	    pthread_mutex_lock(&uiSendMutex);
+	    ui_note_program(instance, argv[0]->i, argv[1]->i);
+	    pthread_mutex_unlock(&uiSendMutex);
 	}
 	
         return osc_program_handler(instance, argv);
 
-    } else if (!strcmp(method, "update") && argc == 1 && !strcmp(types, "s")) {
+    case D3H_OSC_UPDATE:
+	if (argc != 1 || strcmp(types, "s")) break;
 
         return osc_update_handler(instance, argv, source);
 
-    } else if (!strcmp(method, "exiting") && argc == 0) {
+    case D3H_OSC_EXITING:
+	if (argc != 0) break;
 
         return osc_exiting_handler(instance, argv);
+
+    case D3H_OSC_SHOW:
+	if (argc != 0) break;
+
+        return osc_show_handler(instance);
     }
 
     return osc_debug_handler(path, types, argv, argc, data, user_data);
@@ -4,9 +4,9 @@
  *
  * DSSI Soft Synth Interface
  *
- * This is a host for DSSI plugins.  It listens for MIDI events on an
- * ALSA sequencer port, delivers them to DSSI synths and outputs the
- * result via JACK.
+ * This is a host for DSSI plugins.  It listens for MIDI events on
+ * ALSA sequencer ports (or JACK MIDI ports), delivers them to DSSI
+ * synths and outputs the result via JACK.
  */
 
 /*
@@ -25,7 +25,8 @@
 #include <lo/lo.h>
 
 #define D3H_MAX_CHANNELS   16  /* MIDI limit */
-#define D3H_MAX_INSTANCES  (D3H_MAX_CHANNELS)
+#define D3H_MAX_MIDI_PORTS 16  /* MIDI input ports, of D3H_MAX_CHANNELS channels each */
+#define D3H_MAX_INSTANCES  (D3H_MAX_MIDI_PORTS * D3H_MAX_CHANNELS)
 
 /* character used to seperate DSO names from plugin labels on command line */
 #define LABEL_SEP ':'
@@ -37,9 +38,22 @@ struct _d3h_dll_t {
     char                    *name;
     char                    *directory;
     int                      is_DSSI_dll;
+    int                      serialSetup; /* set up its instances one at a time (-L) */
+    char                    *guiBase;     /* library name without directory or .so */
+    char                   **guis;        /* candidate GUI executables, from the plugin index */
+    int                      guiCount;
     DSSI_Descriptor_Function descfn;      /* if is_DSSI_dll is false, this is a LADSPA_Descriptor_Function */
 };
 
+typedef struct _d3h_ui_configure_t d3h_ui_configure_t;
+
+/* A configure call waiting to be passed on to a UI */
+struct _d3h_ui_configure_t {
+    d3h_ui_configure_t *next;
+    char               *key;
+    char               *value;
+};
+
 typedef struct _d3h_plugin_t d3h_plugin_t;
 
 struct _d3h_plugin_t {
@@ -59,16 +73,40 @@ struct _d3h_plugin_t {
 typedef struct _d3h_instance_t d3h_instance_t;
 
 #define MIDI_CONTROLLER_COUNT 128
+#define MIDI_NRPN_COUNT 16384
+
+typedef struct _d3h_controller_state_t d3h_controller_state_t;
+
+/* What one MIDI source has sent an instance so far towards (N)RPNs
+ * and 14-bit controllers */
+struct _d3h_controller_state_t {
+    unsigned char    ccMSB[32];      /* latest value of each controller that can have an LSB */
+    int              nrpnSelected;   /* an NRPN, rather than an RPN or nothing, is selected */
+    int              nrpnMSB;
+    int              nrpnLSB;
+    int              dataMSB;        /* latest data entry MSB */
+};
 
 struct _d3h_instance_t {
     int              number;
     d3h_plugin_t    *plugin;
+    int              midiPort;
     int              channel;
     int              inactive;
     char            *friendly_name;
     int              firstControlIn;                       /* the offset to translate instance control in # to global control in # */
     int             *pluginPortControlInNumbers;           /* maps instance LADSPA port # to global control in # */
     long             controllerMap[MIDI_CONTROLLER_COUNT]; /* maps MIDI controller to global control in # */
+    long            *nrpnMap;                              /* maps NRPN to global control in #, if any are mapped */
+    d3h_controller_state_t
+                    *controllerStates;                     /* by MIDI source */
+    int              firstIn;                              /* the instance's first global audio in buffer # */
+    int              firstOut;                             /* the instance's first global audio out buffer # */
+    int              firstControlOut;                      /* the instance's first global control out # */
+    unsigned long   *audioPortNumbers;                     /* LADSPA port #s of the audio ins, then the audio outs */
+    int              bus;                                  /* bus the outputs are mixed into, in bus mode */
+    float            gain;                                 /* linear gain onto that bus */
+    int              runAdding;                            /* adds into the bus itself, with run_*_adding() */
 
     int              pluginProgramCount;
     DSSI_Program_Descriptor
@@ -79,10 +117,24 @@ struct _d3h_instance_t {
     int              pendingBankMSB;
     int              pendingProgramChange;
 
+    pid_t            uiPid;                                /* of the GUI we started, or 0 */
     lo_address       uiTarget;
     lo_address       uiSource;
+    unsigned long long uiSourceKey;                        /* osc_source_key() of uiSource */
     int              ui_initial_show_sent;
     int              uiNeedsProgramUpdate;
+    int              uiProgramQueued;                      /* a program change is queued for the UI */
+    int             *uiDirtyControls;                      /* control ins waiting to be sent to the UI, oldest first */
+    int              uiDirtyCount;
+    int              uiProgramDirty;                       /* uiBank and uiProgram are waiting to be sent */
+    long             uiBank;
+    long             uiProgram;
+    d3h_ui_configure_t *uiConfigures;                      /* waiting to be sent, oldest first */
+    int              uiShowPending;                        /* send 'show' once the controls have gone */
+    double           uiMessageAllowance;                   /* what the UI may be sent right now */
+    double           uiByteAllowance;
+    long long        uiAllowanceTime;                      /* ms, when the allowances were last topped up */
+    unsigned long    uiUpdatesSuppressed;                  /* superseded before they could be sent */
     char            *ui_osc_control_path;
     char            *ui_osc_configure_path;
     char            *ui_osc_program_path;
@@ -91,5 +143,27 @@ struct _d3h_instance_t {
     char            *ui_osc_show_path;
 };
 
+typedef struct _d3h_run_unit_t d3h_run_unit_t;
+
+/* An instance, or a group of instances run together by
+ * run_multiple_synths(): the unit of work handed to worker threads */
+struct _d3h_run_unit_t {
+    int              first;     /* first instance number */
+    int              count;     /* number of instances */
+    int              firstOut;  /* first output buffer of the first instance */
+    int              outs;      /* output buffers of all the instances */
+};
+
+typedef struct _d3h_osc_route_t d3h_osc_route_t;
+
+/* An entry in the hash table that finds the instance and method an
+ * OSC path is for */
+struct _d3h_osc_route_t {
+    char            *path;      /* NULL if the entry is free */
+    unsigned long    hash;
+    d3h_instance_t  *instance;
+    int              method;
+};
+
 #endif /* _JACK_DSSI_HOST_H */
 
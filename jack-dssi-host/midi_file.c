@@ -0,0 +1,280 @@
+/* -*- c-basic-offset: 4 -*-  vi:set ts=8 sts=4 sw=4: */
+
+/* midi_file.c
+ *
+ * DSSI Soft Synth Interface
+ *
+ * A reader for Standard MIDI Files, for jack-dssi-host's offline
+ * rendering.
+ */
+
+/*
+ * Copyright 2004, 2009 Chris Cannam, Steve Harris and Sean Bolton.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software
+ * for any purpose is hereby granted without fee, provided that the
+ * above copyright notice and this permission notice are included in
+ * all copies or substantial portions of the software.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "midi_file.h"
+
+/* An event as read from a track, before the tracks are merged */
+typedef struct _track_event_t {
+    unsigned long long tick;
+    int                track;
+    int                order;     /* within the track */
+    long               tempo;     /* microseconds per quarter note, or -1 for a channel message */
+    int                port;
+    int                size;
+    unsigned char      data[3];
+} track_event_t;
+
+typedef struct _reader_t {
+    const unsigned char *p;
+    const unsigned char *end;
+    track_event_t       *events;
+    int                  count;
+    int                  allocated;
+} reader_t;
+
+static unsigned long
+read_be(const unsigned char *p, int bytes)
+{
+    unsigned long v = 0;
+
+    while (bytes-- > 0) {
+	v = (v << 8) | *p++;
+    }
+    return v;
+}
+
+/* Reads a variable-length quantity, returning -1 if it runs off the
+ * end of the track or is longer than the four bytes allowed */
+static long
+read_vlq(reader_t *r)
+{
+    long v = 0;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+	if (r->p >= r->end) return -1;
+	v = (v << 7) | (*r->p & 0x7f);
+	if (!(*r->p++ & 0x80)) return v;
+    }
+    return -1;
+}
+
+static track_event_t *
+add_event(reader_t *r)
+{
+    if (r->count == r->allocated) {
+	r->allocated = r->allocated ? 2 * r->allocated : 1024;
+	r->events = (track_event_t *)realloc(r->events,
+					     r->allocated * sizeof(track_event_t));
+    }
+    return &r->events[r->count++];
+}
+
+/* Reads the events of one MTrk chunk, returning 0 on success */
+static int
+read_track(reader_t *r, int track)
+{
+    unsigned long long tick = 0;
+    int running = 0, port = 0, order = 0;
+    int status, type, size;
+    long delta, length;
+    track_event_t *ev;
+
+    while (r->p < r->end) {
+
+	if ((delta = read_vlq(r)) < 0 || r->p >= r->end) return -1;
+	tick += delta;
+
+	if (*r->p & 0x80) {
+	    status = *r->p++;
+	} else if (running) {
+	    status = running;   /* running status */
+	} else {
+	    return -1;
+	}
+
+	if (status == 0xff) {
+	    /* meta event: like sysex, cancels running status */
+	    running = 0;
+	    if (r->p >= r->end) return -1;
+	    type = *r->p++;
+	    if ((length = read_vlq(r)) < 0 || length > r->end - r->p) return -1;
+	    if (type == 0x2f) {
+		return 0;   /* end of track */
+	    } else if (type == 0x51 && length == 3) {
+		ev = add_event(r);
+		ev->tick = tick;
+		ev->track = track;
+		ev->order = order++;
+		ev->tempo = read_be(r->p, 3);
+		ev->size = 0;
+	    } else if (type == 0x21 && length == 1) {
+		port = r->p[0];
+	    }
+	    r->p += length;
+	    continue;
+	}
+
+	if (status == 0xf0 || status == 0xf7) {
+	    /* sysex: of no use to a plugin, and cancels running status */
+	    if ((length = read_vlq(r)) < 0 || length > r->end - r->p) return -1;
+	    r->p += length;
+	    running = 0;
+	    continue;
+	}
+
+	if (status >= 0xf0) return -1;   /* not allowed in a file */
+
+	running = status;
+	size = ((status & 0xf0) == 0xc0 || (status & 0xf0) == 0xd0) ? 2 : 3;
+	if (r->end - r->p < size - 1) return -1;
+	if ((r->p[0] & 0x80) || (size == 3 && (r->p[1] & 0x80))) return -1;
+
+	ev = add_event(r);
+	ev->tick = tick;
+	ev->track = track;
+	ev->order = order++;
+	ev->tempo = -1;
+	ev->port = port;
+	ev->size = size;
+	ev->data[0] = status;
+	ev->data[1] = r->p[0];
+	ev->data[2] = size == 3 ? r->p[1] : 0;
+	r->p += size - 1;
+    }
+
+    return 0;   /* tolerate a missing end of track */
+}
+
+static int
+compare_events(const void *a, const void *b)
+{
+    const track_event_t *ea = (const track_event_t *)a;
+    const track_event_t *eb = (const track_event_t *)b;
+
+    if (ea->tick != eb->tick) return ea->tick < eb->tick ? -1 : 1;
+    if (ea->track != eb->track) return ea->track - eb->track;
+    return ea->order - eb->order;
+}
+
+d3h_midi_file_event_t *
+d3h_midi_file_read(const char *path, int *count, const char **error)
+{
+    FILE *f;
+    unsigned char *contents = NULL;
+    const unsigned char *p, *end;
+    long size;
+    unsigned long length;
+    int format, tracks, division, fps = 0, track = 0, i, n;
+    reader_t r;
+    d3h_midi_file_event_t *events = NULL;
+    double seconds = 0.0, secondsPerTick;
+    unsigned long long lastTick = 0;
+
+    memset(&r, 0, sizeof(r));
+
+    if (!(f = fopen(path, "rb"))) {
+	*error = "can't open file";
+	return NULL;
+    }
+    if (fseek(f, 0, SEEK_END) || (size = ftell(f)) < 0 || fseek(f, 0, SEEK_SET) ||
+	!(contents = (unsigned char *)malloc(size ? size : 1)) ||
+	fread(contents, 1, size, f) != (size_t)size) {
+	fclose(f);
+	free(contents);
+	*error = "can't read file";
+	return NULL;
+    }
+    fclose(f);
+    p = contents;
+    end = contents + size;
+
+    if (size < 14 || memcmp(p, "MThd", 4) || (length = read_be(p + 4, 4)) < 6 ||
+	length > (unsigned long)(size - 8)) {
+	*error = "not a Standard MIDI File";
+	goto fail;
+    }
+    format = read_be(p + 8, 2);
+    tracks = read_be(p + 10, 2);
+    division = read_be(p + 12, 2);
+    if (division & 0x8000) {
+	/* SMPTE time: frames per second (29 meaning 29.97) in the
+	   negated top byte, ticks per frame in the bottom */
+	fps = -(signed char)(division >> 8);
+    }
+    if (format > 2 || division == 0 ||
+	((division & 0x8000) &&
+	 ((division & 0xff) == 0 ||
+	  (fps != 24 && fps != 25 && fps != 29 && fps != 30)))) {
+	*error = "unsupported MIDI file format";
+	goto fail;
+    }
+    p += 8 + length;
+
+    /* a format 2 file's tracks are separate sequences, which we play
+       together anyway, as we do the tracks of a format 1 file */
+
+    while (track < tracks && end - p >= 8) {
+	length = read_be(p + 4, 4);
+	if (length > (unsigned long)(end - p - 8)) {
+	    *error = "truncated MIDI file";
+	    goto fail;
+	}
+	if (!memcmp(p, "MTrk", 4)) {
+	    r.p = p + 8;
+	    r.end = p + 8 + length;
+	    if (read_track(&r, track++)) {
+		*error = "damaged track in MIDI file";
+		goto fail;
+	    }
+	}
+	p += 8 + length;   /* skipping chunks we don't know */
+    }
+
+    qsort(r.events, r.count, sizeof(track_event_t), compare_events);
+
+    if (division & 0x8000) {
+	secondsPerTick = 1.0 / ((fps == 29 ? 29.97 : fps) * (division & 0xff));
+    } else {
+	/* ticks per quarter note, at 120 bpm until told otherwise */
+	secondsPerTick = 0.5 / division;
+    }
+
+    events = (d3h_midi_file_event_t *)malloc((r.count ? r.count : 1) *
+					     sizeof(d3h_midi_file_event_t));
+    for (i = 0, n = 0; i < r.count; i++) {
+	seconds += (r.events[i].tick - lastTick) * secondsPerTick;
+	lastTick = r.events[i].tick;
+	if (r.events[i].tempo >= 0) {
+	    if (!(division & 0x8000) && r.events[i].tempo > 0) {
+		secondsPerTick = r.events[i].tempo / 1000000.0 / division;
+	    }
+	    continue;
+	}
+	events[n].time = seconds;
+	events[n].port = r.events[i].port;
+	events[n].size = r.events[i].size;
+	memcpy(events[n].data, r.events[i].data, 3);
+	++n;
+    }
+
+    free(r.events);
+    free(contents);
+    *count = n;
+    return events;
+
+ fail:
+    free(r.events);
+    free(contents);
+    return NULL;
+}
@@ -0,0 +1,43 @@
+/* -*- c-basic-offset: 4 -*-  vi:set ts=8 sts=4 sw=4: */
+
+/* midi_file.h
+ *
+ * DSSI Soft Synth Interface
+ *
+ * A reader for Standard MIDI Files, for jack-dssi-host's offline
+ * rendering.  The channel messages of every track are merged into a
+ * single list in time order, timed in seconds through the file's
+ * tempo map.
+ */
+
+/*
+ * Copyright 2004, 2009 Chris Cannam, Steve Harris and Sean Bolton.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software
+ * for any purpose is hereby granted without fee, provided that the
+ * above copyright notice and this permission notice are included in
+ * all copies or substantial portions of the software.
+ */
+
+#ifndef _MIDI_FILE_H
+#define _MIDI_FILE_H
+
+typedef struct _d3h_midi_file_event_t d3h_midi_file_event_t;
+
+struct _d3h_midi_file_event_t {
+    double        time;      /* seconds from the start of the file */
+    int           port;      /* from the track's MIDI port meta event, or 0 */
+    int           size;      /* of data: 2 or 3 bytes */
+    unsigned char data[3];   /* the complete channel message */
+};
+
+/* Reads the channel messages from the MIDI file at path, returning
+ * them in time order (events at the same time keep their order within
+ * their track, and tracks their order in the file), and writing their
+ * number to *count.  Returns NULL, with *error saying why, if the
+ * file can't be read or isn't a MIDI file.  The result should be
+ * freed. */
+d3h_midi_file_event_t *d3h_midi_file_read(const char *path, int *count,
+					  const char **error);
+
+#endif /* _MIDI_FILE_H */
@@ -0,0 +1,226 @@
+/* -*- c-basic-offset: 4 -*-  vi:set ts=8 sts=4 sw=4: */
+
+/* worker_pool.c
+ *
+ * DSSI Soft Synth Interface
+ *
+ * A small pool of real-time worker threads for jack-dssi-host.
+ */
+
+/*
+ * Copyright 2004, 2009 Chris Cannam, Steve Harris and Sean Bolton.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software
+ * for any purpose is hereby granted without fee, provided that the
+ * above copyright notice and this permission notice are included in
+ * all copies or substantial portions of the software.
+ */
+
+#ifdef __linux__
+#define _GNU_SOURCE 1   /* for pthread_setaffinity_np */
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+
+#include "worker_pool.h"
+
+/* Jobs are claimed by atomically incrementing a 64-bit word holding
+ * the batch generation in its top half and the next job number in its
+ * bottom half.  Because the generation comes back with the job
+ * number, a worker that wakes late can never claim a job from a batch
+ * other than the one it sees, and the batch can't finish until the
+ * jobs claimed from it have been run.  The previous batch is always
+ * finished before a new one starts, so two batch records suffice; each
+ * records its generation alongside its job count, so that a worker
+ * held up for longer than a batch can't mistake a later batch's
+ * record for its own. */
+
+struct _d3h_batch_t {
+    uint64_t info;      /* generation << 32 | jobs */
+    int      done;
+};
+
+struct _d3h_pool_t {
+    uint64_t            claim;
+    unsigned int        generation;   /* written only by the batch owner */
+    struct _d3h_batch_t batches[2];
+    int                 quit;
+    sem_t               wake;
+    int                 threadCount;
+    pthread_t          *threads;
+    d3h_pool_job_t      job;
+    void               *arg;
+};
+
+/* Claims and runs one job of the current batch; returns 0, having
+ * done nothing, if there were none left in the batch whose
+ * generation is written to *generation. */
+static int
+run_one(d3h_pool_t *pool, unsigned int *generation)
+{
+    uint64_t v = __atomic_fetch_add(&pool->claim, 1, __ATOMIC_ACQ_REL);
+    unsigned int g = (unsigned int)(v >> 32);
+    unsigned int j = (unsigned int)v;
+    struct _d3h_batch_t *batch = &pool->batches[g & 1];
+    uint64_t info = __atomic_load_n(&batch->info, __ATOMIC_ACQUIRE);
+
+    *generation = g;
+
+    if ((unsigned int)(info >> 32) != g || j >= (unsigned int)info) {
+	return 0;
+    }
+    pool->job((int)j, pool->arg);
+    __atomic_fetch_add(&batch->done, 1, __ATOMIC_RELEASE);
+    return 1;
+}
+
+static void *
+worker(void *arg)
+{
+    d3h_pool_t *pool = (d3h_pool_t *)arg;
+    unsigned int g;
+
+    for (;;) {
+	sem_wait(&pool->wake);
+	if (__atomic_load_n(&pool->quit, __ATOMIC_ACQUIRE)) break;
+	while (run_one(pool, &g));
+    }
+    return NULL;
+}
+
+d3h_pool_t *
+d3h_pool_new(int threads, int priority, d3h_pool_job_t job, void *arg)
+{
+    d3h_pool_t *pool;
+    pthread_attr_t attr;
+    struct sched_param param;
+    int i, rt = (priority > 0);
+#ifdef __linux__
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpuset;
+#endif
+
+    pool = (d3h_pool_t *)calloc(1, sizeof(d3h_pool_t));
+    pool->job = job;
+    pool->arg = arg;
+    pool->threads = (pthread_t *)calloc(threads, sizeof(pthread_t));
+
+    if (sem_init(&pool->wake, 0, 0)) {
+	free(pool->threads);
+	free(pool);
+	return NULL;
+    }
+
+    for (i = 0; i < threads; i++) {
+
+	pthread_attr_init(&attr);
+	if (rt) {
+	    param.sched_priority = priority;
+	    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+	    pthread_attr_setschedpolicy(&attr, SCHED_FIFO);
+	    pthread_attr_setschedparam(&attr, &param);
+	}
+
+	if (pthread_create(&pool->threads[i], &attr, worker, pool)) {
+	    if (rt) {
+		/* probably not permitted: carry on without RT scheduling */
+		fprintf(stderr, "worker_pool: can't create SCHED_FIFO worker threads, using normal scheduling\n");
+		rt = 0;
+		pthread_attr_destroy(&attr);
+		--i;
+		continue;
+	    }
+	    pthread_attr_destroy(&attr);
+	    d3h_pool_free(pool);
+	    return NULL;
+	}
+	pthread_attr_destroy(&attr);
+	++pool->threadCount;
+
+#ifdef __linux__
+	/* Leave the first CPU to the JACK thread where we can */
+	if (rt && cpus > 1) {
+	    CPU_ZERO(&cpuset);
+	    CPU_SET((i + 1) % cpus, &cpuset);
+	    pthread_setaffinity_np(pool->threads[i], sizeof(cpu_set_t), &cpuset);
+	}
+#endif
+    }
+
+    return pool;
+}
+
+void
+d3h_pool_begin(d3h_pool_t *pool, int jobs)
+{
+    unsigned int g = pool->generation + 1;
+    struct _d3h_batch_t *batch = &pool->batches[g & 1];
+    int i;
+
+    __atomic_store_n(&batch->done, 0, __ATOMIC_RELAXED);
+    __atomic_store_n(&batch->info, ((uint64_t)g << 32) | (unsigned int)jobs,
+		     __ATOMIC_RELEASE);
+    __atomic_store_n(&pool->claim, (uint64_t)g << 32, __ATOMIC_RELEASE);
+    pool->generation = g;
+
+    for (i = 0; i < pool->threadCount && i < jobs; i++) {
+	sem_post(&pool->wake);
+    }
+}
+
+int
+d3h_pool_done(d3h_pool_t *pool)
+{
+    struct _d3h_batch_t *batch = &pool->batches[pool->generation & 1];
+
+    return __atomic_load_n(&batch->done, __ATOMIC_ACQUIRE) ==
+	(int)(unsigned int)batch->info;
+}
+
+void
+d3h_pool_wait(d3h_pool_t *pool)
+{
+    unsigned int g;
+    int spins = 0;
+
+    while (run_one(pool, &g));
+
+    /* The workers run at the same priority as us, so if one shares
+       our CPU, yielding lets it finish */
+    while (!d3h_pool_done(pool)) {
+	if (++spins > 100) {
+	    sched_yield();
+	    spins = 0;
+	}
+    }
+}
+
+void
+d3h_pool_run(d3h_pool_t *pool, int jobs)
+{
+    d3h_pool_begin(pool, jobs);
+    d3h_pool_wait(pool);
+}
+
+void
+d3h_pool_free(d3h_pool_t *pool)
+{
+    int i;
+
+    __atomic_store_n(&pool->quit, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < pool->threadCount; i++) {
+	sem_post(&pool->wake);
+    }
+    for (i = 0; i < pool->threadCount; i++) {
+	pthread_join(pool->threads[i], NULL);
+    }
+    sem_destroy(&pool->wake);
+    free(pool->threads);
+    free(pool);
+}
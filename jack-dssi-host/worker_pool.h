@@ -0,0 +1,55 @@
+/* -*- c-basic-offset: 4 -*-  vi:set ts=8 sts=4 sw=4: */
+
+/* worker_pool.h
+ *
+ * DSSI Soft Synth Interface
+ *
+ * A small pool of real-time worker threads for jack-dssi-host.  The
+ * audio thread hands the pool a batch of numbered jobs each cycle;
+ * idle workers claim jobs one at a time until the batch is used up,
+ * and the audio thread claims jobs too while it waits for the batch
+ * to finish.
+ */
+
+/*
+ * Copyright 2004, 2009 Chris Cannam, Steve Harris and Sean Bolton.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software
+ * for any purpose is hereby granted without fee, provided that the
+ * above copyright notice and this permission notice are included in
+ * all copies or substantial portions of the software.
+ */
+
+#ifndef _WORKER_POOL_H
+#define _WORKER_POOL_H
+
+typedef struct _d3h_pool_t d3h_pool_t;
+
+typedef void (*d3h_pool_job_t)(int job, void *arg);
+
+/* Starts threads workers, running job(n, arg) for each job n of each
+ * batch.  If priority is greater than zero, the workers are created
+ * SCHED_FIFO at that priority (falling back to normal scheduling if
+ * that isn't permitted) and each is pinned to its own CPU.  Returns
+ * NULL on failure. */
+d3h_pool_t *d3h_pool_new(int threads, int priority, d3h_pool_job_t job, void *arg);
+
+/* Starts a batch of jobs 0 to jobs-1 and returns without waiting.
+ * The previous batch must have been waited for. */
+void d3h_pool_begin(d3h_pool_t *pool, int jobs);
+
+/* Runs any unclaimed jobs of the current batch in the calling
+ * thread, then waits until all of them have finished.  Returns at
+ * once if no batch has been started. */
+void d3h_pool_wait(d3h_pool_t *pool);
+
+/* Returns nonzero if every job of the current batch has finished. */
+int d3h_pool_done(d3h_pool_t *pool);
+
+/* Equivalent to d3h_pool_begin() followed by d3h_pool_wait(). */
+void d3h_pool_run(d3h_pool_t *pool, int jobs);
+
+/* Stops and joins the workers. */
+void d3h_pool_free(d3h_pool_t *pool);
+
+#endif /* _WORKER_POOL_H */
@@ -0,0 +1,986 @@
+/* -*- c-basic-offset: 4 -*-  vi:set ts=8 sts=4 sw=4: */
+
+/* plugin_index.c
+ *
+ * DSSI Soft Synth Interface
+ *
+ * An on-disk index of DSSI and LADSPA plugin libraries.
+ */
+
+/*
+ * Copyright 2004, 2009 Chris Cannam, Steve Harris and Sean Bolton.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software
+ * for any purpose is hereby granted without fee, provided that the
+ * above copyright notice and this permission notice are included in
+ * all copies or substantial portions of the software.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include <ladspa.h>
+#include "dssi.h"
+
+#include "plugin_index.h"
+
+#ifndef RTLD_LOCAL
+#define RTLD_LOCAL  (0)
+#endif
+
+/* The index is a text file.  After the header line, each library has
+ * a "library" line giving the device, inode, modification time and
+ * size it was scanned at, the modification time of its GUI directory,
+ * its type and its path.  This is followed by an "error" line if it
+ * couldn't be loaded, a "plugin" line for each plugin followed by a
+ * "port" line for each port, and a "gui" line for each GUI. */
+#define INDEX_HEADER "dssi-plugin-index 1\n"
+
+#define LINE_MAX_LENGTH 8192
+
+#define DEFAULT_SCAN_TIMEOUT 10  /* seconds */
+
+static const char *typeNames[] = { "none", "ladspa", "dssi" };
+
+/* Returns a copy of s with any newlines or tabs made into spaces, so
+ * that it can't break up a line of the index. */
+static char *
+copy_field(const char *s)
+{
+    char *copy = strdup(s ? s : ""), *c;
+
+    for (c = copy; *c; c++) {
+	if (*c == '\n' || *c == '\r' || *c == '\t') *c = ' ';
+    }
+    return copy;
+}
+
+static void
+clear_library(dssi_index_library_t *library)
+{
+    int i;
+    unsigned long j;
+
+    for (i = 0; i < library->pluginCount; i++) {
+	for (j = 0; j < library->plugins[i].portCount; j++) {
+	    free(library->plugins[i].ports[j].name);
+	}
+	free(library->plugins[i].ports);
+	free(library->plugins[i].label);
+	free(library->plugins[i].name);
+    }
+    free(library->plugins);
+    library->plugins = NULL;
+    library->pluginCount = 0;
+
+    for (i = 0; i < library->guiCount; i++) {
+	free(library->guis[i]);
+    }
+    free(library->guis);
+    library->guis = NULL;
+    library->guiCount = 0;
+
+    free(library->error);
+    library->error = NULL;
+    library->type = DSSI_INDEX_NONE;
+}
+
+static void
+free_library(dssi_index_library_t *library)
+{
+    clear_library(library);
+    free(library->path);
+    free(library);
+}
+
+static dssi_index_library_t *
+new_library(dssi_index_t *index, const char *path)
+{
+    dssi_index_library_t *library, **l;
+    const char *slash;
+
+    library = (dssi_index_library_t *)calloc(1, sizeof(dssi_index_library_t));
+    library->path = strdup(path);
+    slash = strrchr(library->path, '/');
+    library->filename = slash ? slash + 1 : library->path;
+
+    /* keep the libraries in the order they were found */
+    for (l = &index->libraries; *l; l = &(*l)->next);
+    *l = library;
+
+    return library;
+}
+
+static dssi_index_plugin_t *
+add_plugin(dssi_index_library_t *library, const char *label,
+	   const char *name, unsigned long uniqueID)
+{
+    dssi_index_plugin_t *plugin;
+
+    library->plugins = (dssi_index_plugin_t *)
+	realloc(library->plugins, (library->pluginCount + 1) * sizeof(dssi_index_plugin_t));
+    plugin = &library->plugins[library->pluginCount++];
+    memset(plugin, 0, sizeof(dssi_index_plugin_t));
+    plugin->label = copy_field(label);
+    plugin->name = copy_field(name);
+    plugin->uniqueID = uniqueID;
+    plugin->programCount = -1;
+    return plugin;
+}
+
+static dssi_index_port_t *
+add_port(dssi_index_plugin_t *plugin)
+{
+    dssi_index_port_t *port;
+
+    plugin->ports = (dssi_index_port_t *)
+	realloc(plugin->ports, (plugin->portCount + 1) * sizeof(dssi_index_port_t));
+    port = &plugin->ports[plugin->portCount++];
+    memset(port, 0, sizeof(dssi_index_port_t));
+    return port;
+}
+
+static void
+add_gui(dssi_index_library_t *library, const char *path)
+{
+    library->guis = (char **)realloc(library->guis,
+				     (library->guiCount + 1) * sizeof(char *));
+    library->guis[library->guiCount++] = copy_field(path);
+}
+
+/* Returns the path of the directory in which the library's GUIs
+ * live: the library's path without its ".so".  Should be freed. */
+static char *
+gui_directory(const dssi_index_library_t *library)
+{
+    char *directory = strdup(library->path);
+    size_t length = strlen(directory);
+
+    if (length > 3 && !strcasecmp(directory + length - 3, ".so")) {
+	directory[length - 3] = '\0';
+    }
+    return directory;
+}
+
+static long long
+gui_directory_mtime(const dssi_index_library_t *library)
+{
+    char *directory = gui_directory(library);
+    struct stat st;
+    long long mtime = 0;
+
+    if (!stat(directory, &st) && S_ISDIR(st.st_mode)) {
+	mtime = (long long)st.st_mtime;
+    }
+    free(directory);
+    return mtime;
+}
+
+static int
+library_is_current(const dssi_index_library_t *library, const struct stat *st)
+{
+    return (library->device == (unsigned long long)st->st_dev &&
+	    library->inode == (unsigned long long)st->st_ino &&
+	    library->mtime == (long long)st->st_mtime &&
+	    library->size == (long long)st->st_size &&
+	    library->guiMtime == gui_directory_mtime(library));
+}
+
+static int
+count_programs(const DSSI_Descriptor *descriptor)
+{
+    LADSPA_Handle handle;
+    int count = 0;
+
+    if (!descriptor->get_program) return -1;
+
+    /* Some plugins only know their programs once instantiated */
+    handle = descriptor->LADSPA_Plugin->instantiate(descriptor->LADSPA_Plugin, 44100);
+    if (!handle) return 0;
+    while (descriptor->get_program(handle, count)) ++count;
+    if (descriptor->LADSPA_Plugin->cleanup) {
+	descriptor->LADSPA_Plugin->cleanup(handle);
+    }
+    return count;
+}
+
+static void
+scan_plugin(dssi_index_library_t *library, const LADSPA_Descriptor *descriptor,
+	    int programCount)
+{
+    dssi_index_plugin_t *plugin;
+    dssi_index_port_t *port;
+    unsigned long i;
+
+    plugin = add_plugin(library, descriptor->Label, descriptor->Name,
+			descriptor->UniqueID);
+    plugin->programCount = programCount;
+
+    for (i = 0; i < descriptor->PortCount; i++) {
+	port = add_port(plugin);
+	port->descriptor = descriptor->PortDescriptors[i];
+	port->hint = descriptor->PortRangeHints[i].HintDescriptor;
+	port->lower = descriptor->PortRangeHints[i].LowerBound;
+	port->upper = descriptor->PortRangeHints[i].UpperBound;
+	port->name = copy_field(descriptor->PortNames[i]);
+    }
+}
+
+static void
+scan_guis(dssi_index_library_t *library)
+{
+    char *directory = gui_directory(library);
+    char *filename;
+    struct dirent *entry;
+    struct stat st;
+    DIR *dir;
+
+    if (!(dir = opendir(directory))) {
+	free(directory);
+	return;
+    }
+
+    /* a GUI is an executable with an underscore in its name, after
+       the label of the plugin it is for, or the library's name (this
+       is the list jack-dssi-host starts GUIs from) */
+    while ((entry = readdir(dir))) {
+	if (entry->d_name[0] == '.') continue;
+	if (!strchr(entry->d_name, '_')) continue;
+	filename = (char *)malloc(strlen(directory) + strlen(entry->d_name) + 2);
+	sprintf(filename, "%s/%s", directory, entry->d_name);
+	if (!stat(filename, &st) && S_ISREG(st.st_mode) &&
+	    (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH))) {
+	    add_gui(library, filename);
+	}
+	free(filename);
+    }
+
+    closedir(dir);
+    free(directory);
+}
+
+/* Loads the library and records what it holds */
+static void
+scan_library(dssi_index_library_t *library)
+{
+    DSSI_Descriptor_Function dssiDescriptor;
+    LADSPA_Descriptor_Function ladspaDescriptor;
+    const DSSI_Descriptor *dssi;
+    const LADSPA_Descriptor *ladspa;
+    const char *message;
+    void *handle;
+    int i;
+
+    clear_library(library);
+    library->guiMtime = gui_directory_mtime(library);
+
+    /* RTLD_LAZY, as we never run the plugins */
+    if (!(handle = dlopen(library->path, RTLD_LAZY | RTLD_LOCAL))) {
+	message = dlerror();
+	library->error = copy_field(message ? message : "unknown error");
+	return;
+    }
+
+    dssiDescriptor = (DSSI_Descriptor_Function)dlsym(handle, "dssi_descriptor");
+    ladspaDescriptor = (LADSPA_Descriptor_Function)dlsym(handle, "ladspa_descriptor");
+
+    if (dssiDescriptor) {
+	library->type = DSSI_INDEX_DSSI;
+	for (i = 0; (dssi = dssiDescriptor(i)); i++) {
+	    scan_plugin(library, dssi->LADSPA_Plugin, count_programs(dssi));
+	}
+    } else if (ladspaDescriptor) {
+	library->type = DSSI_INDEX_LADSPA;
+	for (i = 0; (ladspa = ladspaDescriptor(i)); i++) {
+	    scan_plugin(library, ladspa, -1);
+	}
+    }
+
+    dlclose(handle);
+
+    scan_guis(library);
+}
+
+static dssi_index_library_t *
+find_entry(dssi_index_t *index, const char *path)
+{
+    dssi_index_library_t *library;
+
+    for (library = index->libraries; library; library = library->next) {
+	if (!strcmp(library->path, path)) return library;
+    }
+    return NULL;
+}
+
+/* Returns the entry for the file at path, whose details are in st,
+ * setting *stale if it is new or has changed and so needs scanning */
+static dssi_index_library_t *
+update_entry(dssi_index_t *index, const char *path, const struct stat *st,
+	     int *stale)
+{
+    dssi_index_library_t *library = find_entry(index, path);
+
+    *stale = 0;
+    if (library && library_is_current(library, st)) {
+	return library;
+    }
+    if (!library) {
+	library = new_library(index, path);
+    }
+    library->device = (unsigned long long)st->st_dev;
+    library->inode = (unsigned long long)st->st_ino;
+    library->mtime = (long long)st->st_mtime;
+    library->size = (long long)st->st_size;
+    index->changed = 1;
+    *stale = 1;
+    return library;
+}
+
+static void
+drop_entry(dssi_index_t *index, dssi_index_library_t *library)
+{
+    dssi_index_library_t **l;
+
+    for (l = &index->libraries; *l; l = &(*l)->next) {
+	if (*l == library) {
+	    *l = library->next;
+	    free_library(library);
+	    index->changed = 1;
+	    return;
+	}
+    }
+}
+
+char *
+dssi_index_default_file(void)
+{
+    const char *file = getenv("DSSI_INDEX");
+    const char *cache = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char *path;
+
+    if (file) {
+	return *file ? strdup(file) : NULL;
+    }
+    if (cache && *cache) {
+	path = (char *)malloc(strlen(cache) + 30);
+	sprintf(path, "%s/dssi/plugin-index", cache);
+    } else if (home) {
+	path = (char *)malloc(strlen(home) + 30);
+	sprintf(path, "%s/.cache/dssi/plugin-index", home);
+    } else {
+	path = NULL;
+    }
+    return path;
+}
+
+/* Removes the newline from the end of line, returning 0 if there
+ * was none (so the line was too long, or the file was cut short). */
+static int
+chop_line(char *line)
+{
+    size_t length = strlen(line);
+
+    if (length == 0 || line[length - 1] != '\n') return 0;
+    line[length - 1] = '\0';
+    return 1;
+}
+
+/* Reads library records into the index, returning 0 if they are
+ * damaged */
+static int
+read_records(dssi_index_t *index, FILE *f)
+{
+    dssi_index_library_t *library = NULL;
+    dssi_index_plugin_t *plugin = NULL;
+    dssi_index_port_t *port;
+    char *line, type[16], *tab;
+    unsigned long long device, inode;
+    long long mtime, size, guiMtime;
+    unsigned long uniqueID, portCount;
+    int n, programCount, descriptor, hint, ok = 0;
+    float lower, upper;
+
+    line = (char *)malloc(LINE_MAX_LENGTH);
+
+    while (fgets(line, LINE_MAX_LENGTH, f)) {
+
+	if (!chop_line(line)) goto done;
+
+	if (sscanf(line, "library %llu %llu %lld %lld %lld %15s %n",
+		   &device, &inode, &mtime, &size, &guiMtime, type, &n) == 6) {
+	    library = new_library(index, line + n);
+	    library->device = device;
+	    library->inode = inode;
+	    library->mtime = mtime;
+	    library->size = size;
+	    library->guiMtime = guiMtime;
+	    for (library->type = DSSI_INDEX_DSSI; library->type > DSSI_INDEX_NONE;
+		 --library->type) {
+		if (!strcmp(type, typeNames[library->type])) break;
+	    }
+	    plugin = NULL;
+
+	} else if (!library) {
+	    goto done;
+
+	} else if (!strncmp(line, "error ", 6)) {
+	    free(library->error);
+	    library->error = strdup(line + 6);
+
+	} else if (sscanf(line, "plugin %lu %lu %d %n",
+			  &uniqueID, &portCount, &programCount, &n) == 3) {
+	    if (!(tab = strchr(line + n, '\t'))) goto done;
+	    *tab = '\0';
+	    plugin = add_plugin(library, line + n, tab + 1, uniqueID);
+	    plugin->programCount = programCount;
+
+	} else if (plugin && sscanf(line, "port %d %d %g %g %n",
+				    &descriptor, &hint, &lower, &upper, &n) == 4) {
+	    port = add_port(plugin);
+	    port->descriptor = descriptor;
+	    port->hint = hint;
+	    port->lower = lower;
+	    port->upper = upper;
+	    port->name = strdup(line + n);
+
+	} else if (!strncmp(line, "gui ", 4)) {
+	    add_gui(library, line + 4);
+
+	} else {
+	    goto done;
+	}
+    }
+
+    ok = 1;
+
+ done:
+    free(line);
+    return ok;
+}
+
+static int
+read_index(dssi_index_t *index, FILE *f)
+{
+    char header[sizeof(INDEX_HEADER)];
+
+    if (!fgets(header, sizeof(header), f) || strcmp(header, INDEX_HEADER)) {
+	return 0;
+    }
+    return read_records(index, f);
+}
+
+dssi_index_t *
+dssi_index_load(const char *file)
+{
+    dssi_index_t *index;
+    dssi_index_library_t *library;
+    FILE *f;
+
+    index = (dssi_index_t *)calloc(1, sizeof(dssi_index_t));
+    index->file = file ? strdup(file) : NULL;
+    index->workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (index->workers < 1) index->workers = 1;
+    index->timeout = DEFAULT_SCAN_TIMEOUT;
+
+    if (!file || !(f = fopen(file, "r"))) {
+	return index;
+    }
+
+    if (!read_index(index, f)) {
+	/* start afresh */
+	while ((library = index->libraries)) {
+	    index->libraries = library->next;
+	    free_library(library);
+	}
+	index->changed = 1;
+    }
+
+    fclose(f);
+    return index;
+}
+
+/* Creates the directories leading to file, as mkdir -p */
+static void
+make_parent_directories(const char *file)
+{
+    char *path = strdup(file), *slash;
+
+    for (slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+	*slash = '\0';
+	mkdir(path, 0755);
+	*slash = '/';
+    }
+    free(path);
+}
+
+static void
+write_library(dssi_index_library_t *library, FILE *f)
+{
+    dssi_index_plugin_t *plugin;
+    dssi_index_port_t *port;
+    unsigned long j;
+    int i;
+
+    fprintf(f, "library %llu %llu %lld %lld %lld %s %s\n",
+	    library->device, library->inode, library->mtime, library->size,
+	    library->guiMtime, typeNames[library->type], library->path);
+    if (library->error) {
+	fprintf(f, "error %s\n", library->error);
+    }
+    for (i = 0; i < library->pluginCount; i++) {
+	plugin = &library->plugins[i];
+	fprintf(f, "plugin %lu %lu %d %s\t%s\n", plugin->uniqueID,
+		plugin->portCount, plugin->programCount, plugin->label, plugin->name);
+	for (j = 0; j < plugin->portCount; j++) {
+	    port = &plugin->ports[j];
+	    fprintf(f, "port %d %d %.9g %.9g %s\n", port->descriptor,
+		    port->hint, port->lower, port->upper, port->name);
+	}
+    }
+    for (i = 0; i < library->guiCount; i++) {
+	fprintf(f, "gui %s\n", library->guis[i]);
+    }
+}
+
+static void
+write_index(dssi_index_t *index, FILE *f)
+{
+    dssi_index_library_t *library;
+
+    fputs(INDEX_HEADER, f);
+
+    for (library = index->libraries; library; library = library->next) {
+	write_library(library, f);
+    }
+}
+
+/* Libraries are scanned by child processes, so that one that crashes
+ * or hangs when loaded costs only its own entry.  Each child writes
+ * its library's record back down a pipe, in the index file format. */
+
+typedef struct _scan_job_t scan_job_t;
+
+struct _scan_job_t {
+    dssi_index_library_t *library;
+    pid_t                 pid;        /* 0 if the job is free */
+    int                   fd;         /* the read end of the child's pipe */
+    char                 *record;     /* what the child has written so far */
+    size_t                length;
+    size_t                size;
+    long long             deadline;   /* ms */
+};
+
+static long long
+now_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Forks a child to scan the library.  Returns 0 if that failed. */
+static int
+start_job(dssi_index_t *index, scan_job_t *job, dssi_index_library_t *library)
+{
+    int fds[2];
+    FILE *f;
+
+    if (pipe(fds)) return 0;
+
+    /* or the child would write out anything still buffered again */
+    fflush(stdout);
+    fflush(stderr);
+
+    if ((job->pid = fork()) < 0) {
+	job->pid = 0;
+	close(fds[0]);
+	close(fds[1]);
+	return 0;
+    }
+
+    if (job->pid == 0) {
+	close(fds[0]);
+	scan_library(library);
+	if ((f = fdopen(fds[1], "w"))) {
+	    write_library(library, f);
+	    fclose(f);
+	}
+	_exit(0);
+    }
+
+    close(fds[1]);
+    job->library = library;
+    job->fd = fds[0];
+    job->length = 0;
+    job->deadline = now_ms() + index->timeout * 1000LL;
+    return 1;
+}
+
+/* Moves what the child found into the job's library.  Returns 0 if
+ * the record is missing or damaged. */
+static int
+take_record(scan_job_t *job)
+{
+    dssi_index_t records;
+    dssi_index_library_t *scanned = NULL, *library = job->library;
+    FILE *f;
+    int ok;
+
+    if (!job->length || !(f = fmemopen(job->record, job->length, "r"))) {
+	return 0;
+    }
+    memset(&records, 0, sizeof(records));
+    ok = (read_records(&records, f) && (scanned = records.libraries) &&
+	  !scanned->next);
+    fclose(f);
+
+    if (ok) {
+	library->type = scanned->type;
+	library->guiMtime = scanned->guiMtime;
+	library->error = scanned->error;
+	library->pluginCount = scanned->pluginCount;
+	library->plugins = scanned->plugins;
+	library->guiCount = scanned->guiCount;
+	library->guis = scanned->guis;
+	scanned->error = NULL;
+	scanned->pluginCount = 0;
+	scanned->plugins = NULL;
+	scanned->guiCount = 0;
+	scanned->guis = NULL;
+    }
+
+    while ((scanned = records.libraries)) {
+	records.libraries = scanned->next;
+	free_library(scanned);
+    }
+    return ok;
+}
+
+static void
+finish_job(dssi_index_t *index, scan_job_t *job, int timedOut)
+{
+    char message[80];
+    int status = 0;
+
+    if (timedOut) {
+	kill(job->pid, SIGKILL);
+    }
+    close(job->fd);
+    waitpid(job->pid, &status, 0);
+
+    clear_library(job->library);
+
+    if (timedOut || !WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+	!take_record(job)) {
+	if (timedOut) {
+	    sprintf(message, "took longer than %d seconds to load", index->timeout);
+	} else if (WIFSIGNALED(status)) {
+	    sprintf(message, "crashed when loaded (signal %d)", WTERMSIG(status));
+	} else {
+	    sprintf(message, "couldn't be scanned");
+	}
+	clear_library(job->library);
+	job->library->error = strdup(message);
+	job->library->guiMtime = gui_directory_mtime(job->library);
+    }
+
+    job->pid = 0;
+}
+
+static void
+scan_libraries(dssi_index_t *index, dssi_index_library_t **libraries, int count)
+{
+    scan_job_t *jobs, *job;
+    struct pollfd *fds;
+    int *polled;
+    int i, n, next = 0, running = 0, timeout;
+    long long now;
+    ssize_t r;
+
+    if (index->workers < 1) {
+	for (i = 0; i < count; i++) {
+	    scan_library(libraries[i]);
+	}
+	return;
+    }
+
+    jobs = (scan_job_t *)calloc(index->workers, sizeof(scan_job_t));
+    fds = (struct pollfd *)calloc(index->workers, sizeof(struct pollfd));
+    polled = (int *)calloc(index->workers, sizeof(int));
+
+    while (next < count || running > 0) {
+
+	/* keep the workers busy */
+	for (i = 0; i < index->workers && next < count; i++) {
+	    if (jobs[i].pid) continue;
+	    if (start_job(index, &jobs[i], libraries[next])) {
+		++running;
+	    } else {
+		/* can't fork, so take our chances */
+		scan_library(libraries[next]);
+	    }
+	    ++next;
+	}
+	if (!running) continue;
+
+	now = now_ms();
+	timeout = -1;
+	for (i = 0, n = 0; i < index->workers; i++) {
+	    if (!jobs[i].pid) continue;
+	    fds[n].fd = jobs[i].fd;
+	    fds[n].events = POLLIN;
+	    fds[n].revents = 0;
+	    polled[n++] = i;
+	    if (timeout < 0 || jobs[i].deadline - now < timeout) {
+		timeout = (jobs[i].deadline > now ? (int)(jobs[i].deadline - now) : 0);
+	    }
+	}
+
+	if (poll(fds, n, timeout) < 0 && errno != EINTR) {
+	    break;
+	}
+
+	now = now_ms();
+	for (i = 0; i < n; i++) {
+	    job = &jobs[polled[i]];
+	    if (fds[i].revents) {
+		if (job->size - job->length < 4096) {
+		    job->size = (job->size ? job->size * 2 : 16384);
+		    job->record = (char *)realloc(job->record, job->size);
+		}
+		r = read(job->fd, job->record + job->length, job->size - job->length);
+		if (r > 0) {
+		    job->length += r;
+		    continue;
+		}
+		if (r < 0 && errno == EINTR) continue;
+		finish_job(index, job, 0);
+		--running;
+	    } else if (now >= job->deadline) {
+		finish_job(index, job, 1);
+		--running;
+	    }
+	}
+    }
+
+    for (i = 0; i < index->workers; i++) {
+	if (jobs[i].pid) {
+	    finish_job(index, &jobs[i], 1);
+	}
+	free(jobs[i].record);
+    }
+    free(jobs);
+    free(fds);
+    free(polled);
+}
+
+int
+dssi_index_save(dssi_index_t *index)
+{
+    char *temporary;
+    FILE *f;
+    int failed;
+
+    if (!index->file || !index->changed) return 0;
+
+    make_parent_directories(index->file);
+
+    /* write a new file and rename it over the old, so that nobody
+     * reads a half-written index */
+    temporary = (char *)malloc(strlen(index->file) + 24);
+    sprintf(temporary, "%s.%ld", index->file, (long)getpid());
+
+    if (!(f = fopen(temporary, "w"))) {
+	free(temporary);
+	return -1;
+    }
+    write_index(index, f);
+    failed = ferror(f);
+    if (fclose(f) || failed || rename(temporary, index->file)) {
+	unlink(temporary);
+	free(temporary);
+	return -1;
+    }
+
+    free(temporary);
+    index->changed = 0;
+    return 0;
+}
+
+void
+dssi_index_set_scanning(dssi_index_t *index, int workers, int timeout)
+{
+    index->workers = workers;
+    index->timeout = timeout;
+}
+
+void
+dssi_index_free(dssi_index_t *index)
+{
+    dssi_index_library_t *library;
+
+    while ((library = index->libraries)) {
+	index->libraries = library->next;
+	free_library(library);
+    }
+    free(index->file);
+    free(index);
+}
+
+dssi_index_library_t *
+dssi_index_get(dssi_index_t *index, const char *path)
+{
+    dssi_index_library_t *library;
+    struct stat st;
+    int stale;
+
+    if (stat(path, &st) || S_ISDIR(st.st_mode)) {
+	if ((library = find_entry(index, path))) {
+	    drop_entry(index, library);
+	}
+	return NULL;
+    }
+    library = update_entry(index, path, &st, &stale);
+    if (stale) {
+	scan_libraries(index, &library, 1);
+    }
+    return library;
+}
+
+int
+dssi_index_in_directory(const dssi_index_library_t *library, const char *directory)
+{
+    size_t length = strlen(directory);
+
+    while (length > 0 && directory[length - 1] == '/') --length;
+
+    return (!strncmp(library->path, directory, length) &&
+	    library->path + length + 1 == library->filename);
+}
+
+int
+dssi_index_scan_directory(dssi_index_t *index, const char *directory)
+{
+    dssi_index_library_t *library, *next, **stale = NULL;
+    struct dirent *entry;
+    struct stat st;
+    char *path;
+    size_t length = strlen(directory);
+    int staleCount = 0, isStale;
+    DIR *dir;
+
+    while (length > 0 && directory[length - 1] == '/') --length;
+
+    if (!(dir = opendir(directory))) {
+	return -1;
+    }
+
+    for (library = index->libraries; library; library = library->next) {
+	library->seen = 0;
+    }
+
+    while ((entry = readdir(dir))) {
+
+	if (!strcmp(entry->d_name, ".") || !strcmp(entry->d_name, ".."))
+	    continue;
+
+	path = (char *)malloc(length + strlen(entry->d_name) + 2);
+	sprintf(path, "%.*s/%s", (int)length, directory, entry->d_name);
+
+	if (!stat(path, &st) && !S_ISDIR(st.st_mode)) {
+	    library = update_entry(index, path, &st, &isStale);
+	    library->seen = 1;
+	    if (isStale) {
+		stale = (dssi_index_library_t **)
+		    realloc(stale, (staleCount + 1) * sizeof(dssi_index_library_t *));
+		stale[staleCount++] = library;
+	    }
+	}
+	free(path);
+    }
+
+    closedir(dir);
+
+    scan_libraries(index, stale, staleCount);
+    free(stale);
+
+    /* forget libraries that have gone */
+    for (library = index->libraries; library; library = next) {
+	next = library->next;
+	if (!library->seen && dssi_index_in_directory(library, directory)) {
+	    drop_entry(index, library);
+	}
+    }
+
+    return 0;
+}
+
+dssi_index_library_t *
+dssi_index_find_library(dssi_index_t *index, const char *dssiPath,
+			const char *filename)
+{
+    dssi_index_library_t *library = NULL;
+    char *path, *element, *elements, *state;
+
+    elements = strdup(dssiPath);
+
+    for (element = strtok_r(elements, ":", &state); element;
+	 element = strtok_r(NULL, ":", &state)) {
+	if (element[0] != '/') continue;
+	path = (char *)malloc(strlen(element) + strlen(filename) + 2);
+	sprintf(path, "%s/%s", element, filename);
+	library = dssi_index_get(index, path);
+	free(path);
+	if (library) break;
+    }
+
+    free(elements);
+    return library;
+}
+
+dssi_index_library_t *
+dssi_index_find_label(dssi_index_t *index, const char *dssiPath,
+		      const char *label, dssi_index_plugin_t **plugin)
+{
+    dssi_index_library_t *library;
+    char *element, *elements, *state;
+    int i;
+
+    elements = strdup(dssiPath);
+
+    for (element = strtok_r(elements, ":", &state); element;
+	 element = strtok_r(NULL, ":", &state)) {
+
+	if (element[0] != '/' || dssi_index_scan_directory(index, element)) {
+	    continue;
+	}
+
+	for (library = index->libraries; library; library = library->next) {
+	    if (!dssi_index_in_directory(library, element)) continue;
+	    for (i = 0; i < library->pluginCount; i++) {
+		if (!strcmp(library->plugins[i].label, label)) {
+		    if (plugin) *plugin = &library->plugins[i];
+		    free(elements);
+		    return library;
+		}
+	    }
+	}
+    }
+
+    free(elements);
+    return NULL;
+}
@@ -0,0 +1,140 @@
+/* -*- c-basic-offset: 4 -*-  vi:set ts=8 sts=4 sw=4: */
+
+/* plugin_index.h
+ *
+ * DSSI Soft Synth Interface
+ *
+ * An on-disk index of the DSSI and LADSPA plugin libraries found on
+ * DSSI_PATH, shared by jack-dssi-host and dssi_list_plugins.  Each
+ * library's entry records its plugins' labels, names, ports and
+ * program counts, and the GUI executables found beside it, so that
+ * listing plugins or finding a label needn't load every library.
+ *
+ * An entry is trusted for as long as the library's device, inode,
+ * size and modification time, and the modification time of its GUI
+ * directory, are unchanged; otherwise the library is loaded and
+ * scanned again.  Libraries are scanned in child processes, several
+ * at a time, so that one that crashes or hangs when loaded is only
+ * recorded as having done so.
+ */
+
+/*
+ * Copyright 2004, 2009 Chris Cannam, Steve Harris and Sean Bolton.
+ *
+ * Permission to use, copy, modify, distribute, and sell this software
+ * for any purpose is hereby granted without fee, provided that the
+ * above copyright notice and this permission notice are included in
+ * all copies or substantial portions of the software.
+ */
+
+#ifndef _PLUGIN_INDEX_H
+#define _PLUGIN_INDEX_H
+
+#include <sys/types.h>
+#include <ladspa.h>
+
+/* library types */
+#define DSSI_INDEX_NONE   0   /* not a plugin library, or couldn't be loaded */
+#define DSSI_INDEX_LADSPA 1
+#define DSSI_INDEX_DSSI   2
+
+typedef struct _dssi_index_port_t dssi_index_port_t;
+
+struct _dssi_index_port_t {
+    LADSPA_PortDescriptor          descriptor;
+    LADSPA_PortRangeHintDescriptor hint;
+    LADSPA_Data                    lower;
+    LADSPA_Data                    upper;
+    char                          *name;
+};
+
+typedef struct _dssi_index_plugin_t dssi_index_plugin_t;
+
+struct _dssi_index_plugin_t {
+    char              *label;
+    char              *name;
+    unsigned long      uniqueID;
+    unsigned long      portCount;
+    dssi_index_port_t *ports;
+    int                programCount;  /* -1 if the plugin has no programs */
+};
+
+typedef struct _dssi_index_library_t dssi_index_library_t;
+
+struct _dssi_index_library_t {
+    dssi_index_library_t *next;
+    char                 *path;
+    const char           *filename;    /* within path */
+    unsigned long long    device;
+    unsigned long long    inode;
+    long long             mtime;
+    long long             size;
+    long long             guiMtime;    /* of the GUI directory, or 0 if none */
+    int                   type;
+    char                 *error;       /* why it couldn't be loaded, if it couldn't */
+    int                   pluginCount;
+    dssi_index_plugin_t  *plugins;
+    int                   guiCount;
+    char                **guis;        /* paths of the GUI executables */
+    int                   seen;
+};
+
+typedef struct _dssi_index_t dssi_index_t;
+
+struct _dssi_index_t {
+    char                 *file;        /* NULL if the index is not kept on disk */
+    dssi_index_library_t *libraries;
+    int                   changed;     /* since it was loaded */
+    int                   workers;     /* scanning processes, or 0 to scan in this one */
+    int                   timeout;     /* seconds a scanning process may take */
+};
+
+/* Returns the index file to use: $DSSI_INDEX if set (an empty value
+ * meaning none), else dssi/plugin-index in $XDG_CACHE_HOME or
+ * ~/.cache.  The result should be freed. */
+char *dssi_index_default_file(void);
+
+/* Reads the index in file, which may be NULL.  A missing, unreadable
+ * or out-of-date file gives an empty index, to be filled as libraries
+ * are looked up.  Never returns NULL. */
+dssi_index_t *dssi_index_load(const char *file);
+
+/* Writes the index back to its file if it has changed.  Returns 0 on
+ * success. */
+int dssi_index_save(dssi_index_t *index);
+
+/* Scans libraries in up to workers child processes at once (by
+ * default, one per CPU), giving each timeout seconds (by default 10).
+ * If workers is 0, libraries are scanned in the calling process. */
+void dssi_index_set_scanning(dssi_index_t *index, int workers, int timeout);
+
+void dssi_index_free(dssi_index_t *index);
+
+/* Returns the up-to-date entry for the library at path, scanning it
+ * if there is none, or NULL if there is no such file. */
+dssi_index_library_t *dssi_index_get(dssi_index_t *index, const char *path);
+
+/* Brings the entries for every file in directory up to date, and
+ * drops those for files that have gone.  Returns -1 if the directory
+ * can't be read. */
+int dssi_index_scan_directory(dssi_index_t *index, const char *directory);
+
+/* Returns nonzero if the library is directly within directory. */
+int dssi_index_in_directory(const dssi_index_library_t *library,
+			    const char *directory);
+
+/* Finds the library called filename in the first element of the
+ * colon-separated dssiPath that has one. */
+dssi_index_library_t *dssi_index_find_library(dssi_index_t *index,
+					      const char *dssiPath,
+					      const char *filename);
+
+/* Finds the first plugin with the given label in the libraries on
+ * dssiPath, scanning the directories as needed, and returns its
+ * library, writing the plugin to *plugin if that isn't NULL. */
+dssi_index_library_t *dssi_index_find_label(dssi_index_t *index,
+					    const char *dssiPath,
+					    const char *label,
+					    dssi_index_plugin_t **plugin);
+
+#endif /* _PLUGIN_INDEX_H */
@@ -0,0 +1,133 @@
+/*
+ *  Tests for the jack-dssi-host MIDI event ring.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "event_ring.h"
+
+#define RING_SIZE  8
+#define STRESS_RING_SIZE 256
+#define STRESS_EVENTS 1000000
+
+static snd_seq_event_t buffer[STRESS_RING_SIZE];
+static d3h_event_ring_t ring;
+
+static void *
+producer(void *arg)
+{
+    snd_seq_event_t ev;
+    unsigned int n = 0;
+
+    memset(&ev, 0, sizeof(ev));
+    while (n < STRESS_EVENTS) {
+	ev.data.raw32.d[0] = n;
+	ev.data.raw32.d[1] = ~n;
+	ev.data.raw32.d[2] = n * 3;
+	if (d3h_event_ring_write(&ring, &ev) == 0) ++n;
+	else usleep(1);
+    }
+    return NULL;
+}
+
+int main()
+{
+    snd_seq_event_t ev, *p;
+    pthread_t thread;
+    unsigned int i;
+
+    memset(&ev, 0, sizeof(ev));
+    d3h_event_ring_init(&ring, buffer, RING_SIZE);
+
+    if (d3h_event_ring_peek(&ring)) {
+	printf("empty ring returned an event %s:%d\n", __FILE__, __LINE__);
+	return 1;
+    }
+
+    /* a ring of size N holds exactly N events */
+    for (i = 0; i < RING_SIZE; i++) {
+	ev.data.control.value = i;
+	if (d3h_event_ring_write(&ring, &ev)) {
+	    printf("write %u failed on non-full ring %s:%d\n", i, __FILE__, __LINE__);
+	    return 1;
+	}
+    }
+    if (d3h_event_ring_write_space(&ring) != 0 ||
+	d3h_event_ring_read_space(&ring) != RING_SIZE ||
+	d3h_event_ring_write(&ring, &ev) != -1 ||
+	d3h_event_ring_dropped(&ring) != 1) {
+	printf("full ring accepted an event %s:%d\n", __FILE__, __LINE__);
+	return 1;
+    }
+
+    /* events come out in order, across the wrap */
+    for (i = 0; i < RING_SIZE * 3; i++) {
+	p = d3h_event_ring_peek(&ring);
+	if (!p || p->data.control.value != (int)i) {
+	    printf("wrong event %u %s:%d\n", i, __FILE__, __LINE__);
+	    return 1;
+	}
+	d3h_event_ring_advance(&ring);
+	ev.data.control.value = i + RING_SIZE;
+	if (i + RING_SIZE < RING_SIZE * 3 && d3h_event_ring_write(&ring, &ev)) {
+	    printf("write failed after read %s:%d\n", __FILE__, __LINE__);
+	    return 1;
+	}
+    }
+    if (d3h_event_ring_peek(&ring) ||
+	d3h_event_ring_write_space(&ring) != RING_SIZE) {
+	printf("drained ring not empty %s:%d\n", __FILE__, __LINE__);
+	return 1;
+    }
+
+    /* a reserved write leaves the reserve free for ordinary writes */
+    for (i = 0; i < RING_SIZE - 2; i++) {
+	if (d3h_event_ring_write_reserved(&ring, &ev, 2)) {
+	    printf("reserved write %u failed %s:%d\n", i, __FILE__, __LINE__);
+	    return 1;
+	}
+    }
+    if (d3h_event_ring_write_reserved(&ring, &ev, 2) != -1 ||
+	d3h_event_ring_dropped(&ring) != 2 ||
+	d3h_event_ring_write(&ring, &ev) ||
+	d3h_event_ring_write(&ring, &ev)) {
+	printf("reserve not kept %s:%d\n", __FILE__, __LINE__);
+	return 1;
+    }
+
+    /* concurrent producer: every event arrives once, whole and in order */
+    d3h_event_ring_init(&ring, buffer, STRESS_RING_SIZE);
+    pthread_create(&thread, NULL, producer, NULL);
+    for (i = 0; i < STRESS_EVENTS; ) {
+	if (!(p = d3h_event_ring_peek(&ring))) {
+	    usleep(1);
+	    continue;
+	}
+	if (p->data.raw32.d[0] != i || p->data.raw32.d[1] != ~i ||
+	    p->data.raw32.d[2] != i * 3) {
+	    printf("torn or misordered event %u %s:%d\n", i, __FILE__, __LINE__);
+	    return 1;
+	}
+	d3h_event_ring_advance(&ring);
+	++i;
+    }
+    pthread_join(thread, NULL);
+
+    printf("test passed\n");
+
+    return 0;
+}
+
+/* vi:set ts=8 sts=4 sw=4: */
@@ -0,0 +1,101 @@
+/*
+ *  Tests for reaping the GUI processes jack-dssi-host starts.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <signal.h>
+#include <unistd.h>
+#include "gui_process.h"
+
+/* Starts a child that exits at once, or that runs until killed */
+static pid_t
+start_child(int exitAtOnce)
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+	if (!exitAtOnce) pause();
+	_exit(0);
+    }
+    return pid;
+}
+
+/* Reaps *pid, giving it up to five seconds to go */
+static int
+reap_within_timeout(pid_t *pid)
+{
+    int i;
+
+    for (i = 0; i < 500; i++) {
+	if (d3h_gui_reap(pid)) return 1;
+	usleep(10000);
+    }
+    return 0;
+}
+
+int main()
+{
+    pid_t pid, gui;
+
+    /* nothing started, nothing to wait for */
+    gui = 0;
+    if (!d3h_gui_reap(&gui) || gui != 0) {
+	printf("no GUI not taken as gone %s:%d\n", __FILE__, __LINE__);
+	return 1;
+    }
+
+    /* a GUI that is still running is left alone */
+    if ((gui = pid = start_child(0)) < 0) {
+	printf("can't start a child %s:%d\n", __FILE__, __LINE__);
+	return 1;
+    }
+    if (d3h_gui_reap(&gui) || gui != pid) {
+	printf("running GUI taken as gone %s:%d\n", __FILE__, __LINE__);
+	kill(pid, SIGKILL);
+	return 1;
+    }
+
+    /* but once killed, is reaped */
+    kill(pid, SIGKILL);
+    if (!reap_within_timeout(&gui) || gui != 0) {
+	printf("killed GUI not reaped %s:%d\n", __FILE__, __LINE__);
+	return 1;
+    }
+
+    /* a GUI that has exited is reaped, leaving no zombie */
+    if ((gui = pid = start_child(1)) < 0) {
+	printf("can't start a child %s:%d\n", __FILE__, __LINE__);
+	return 1;
+    }
+    if (!reap_within_timeout(&gui) || gui != 0) {
+	printf("exited GUI not reaped %s:%d\n", __FILE__, __LINE__);
+	return 1;
+    }
+    if (waitpid(pid, NULL, WNOHANG) != -1 || errno != ECHILD) {
+	printf("exited GUI left a zombie %s:%d\n", __FILE__, __LINE__);
+	return 1;
+    }
+
+    /* and reaping it again does no harm */
+    gui = pid;
+    if (!d3h_gui_reap(&gui) || gui != 0) {
+	printf("reaped GUI not taken as gone %s:%d\n", __FILE__, __LINE__);
+	return 1;
+    }
+
+    printf("test passed\n");
+    return 0;
+}
+
+/* vi:set ts=8 sts=4 sw=4: */
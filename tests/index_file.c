@@ -0,0 +1,117 @@
+/*
+ *  Tests for the plugin index shared by jack-dssi-host and
+ *  dssi_list_plugins.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "plugin_index.h"
+
+static char directory[] = "/tmp/dssi-index-test-XXXXXX";
+static char library[64], file[64];
+
+static void
+write_file(const char *path, const char *contents)
+{
+    FILE *f = fopen(path, "w");
+    fputs(contents, f);
+    fclose(f);
+}
+
+int main()
+{
+    dssi_index_t *index;
+    dssi_index_library_t *entry;
+    int ok = 0;
+
+    if (!mkdtemp(directory)) {
+	printf("can't make a directory %s:%d\n", __FILE__, __LINE__);
+	return 1;
+    }
+    sprintf(library, "%s/junk.so", directory);
+    sprintf(file, "%s.index", directory);
+
+    /* a file that isn't a library is indexed as such */
+    write_file(library, "not a library");
+    index = dssi_index_load(file);
+    if (index->libraries || dssi_index_scan_directory(index, directory)) {
+	printf("scan failed %s:%d\n", __FILE__, __LINE__);
+	goto done;
+    }
+    entry = index->libraries;
+    if (!entry || entry->next || strcmp(entry->filename, "junk.so") ||
+	entry->type != DSSI_INDEX_NONE || !entry->error || !index->changed ||
+	!dssi_index_in_directory(entry, directory)) {
+	printf("wrong entry for non-library %s:%d\n", __FILE__, __LINE__);
+	goto done;
+    }
+    if (dssi_index_save(index) || index->changed) {
+	printf("save failed %s:%d\n", __FILE__, __LINE__);
+	goto done;
+    }
+    dssi_index_free(index);
+
+    /* the saved entry is read back and trusted while the file is unchanged */
+    index = dssi_index_load(file);
+    dssi_index_scan_directory(index, directory);
+    entry = index->libraries;
+    if (!entry || entry->next || strcmp(entry->filename, "junk.so") ||
+	entry->type != DSSI_INDEX_NONE || !entry->error || index->changed) {
+	printf("entry not reloaded %s:%d\n", __FILE__, __LINE__);
+	goto done;
+    }
+    if (dssi_index_find_library(index, directory, "junk.so") != entry ||
+	dssi_index_find_library(index, directory, "missing.so") ||
+	dssi_index_find_label(index, directory, "LABEL", NULL)) {
+	printf("wrong lookup %s:%d\n", __FILE__, __LINE__);
+	goto done;
+    }
+
+    /* a changed file is scanned again, and a removed one forgotten */
+    write_file(library, "still not a library");
+    dssi_index_scan_directory(index, directory);
+    if (!index->changed || !index->libraries) {
+	printf("change not noticed %s:%d\n", __FILE__, __LINE__);
+	goto done;
+    }
+    unlink(library);
+    dssi_index_scan_directory(index, directory);
+    if (index->libraries) {
+	printf("removed library kept %s:%d\n", __FILE__, __LINE__);
+	goto done;
+    }
+    dssi_index_free(index);
+
+    /* a damaged index is thrown away */
+    write_file(file, "dssi-plugin-index 1\nlibrary garbage\n");
+    index = dssi_index_load(file);
+    if (index->libraries || !index->changed) {
+	printf("damaged index used %s:%d\n", __FILE__, __LINE__);
+	goto done;
+    }
+
+    printf("test passed\n");
+    ok = 1;
+
+ done:
+    dssi_index_free(index);
+    unlink(library);
+    unlink(file);
+    rmdir(directory);
+
+    return ok ? 0 : 1;
+}
+
+/* vi:set ts=8 sts=4 sw=4: */
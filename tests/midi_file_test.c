@@ -0,0 +1,185 @@
+/*
+ *  Tests for the Standard MIDI File reader used by jack-dssi-host's
+ *  offline rendering.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <math.h>
+#include "midi_file.h"
+
+static char file[] = "/tmp/dssi-midi-test-XXXXXX";
+
+/* Format 1, 96 ticks per quarter note.  The first track halves the
+ * tempo after a beat; the second sets port 2, uses running status,
+ * has a sysex and an unknown meta event, and plays a program change
+ * at the same tick as the first track's tempo change. */
+static const unsigned char smf[] = {
+    'M', 'T', 'h', 'd', 0, 0, 0, 6,  0, 1,  0, 2,  0, 96,
+    'M', 'T', 'r', 'k', 0, 0, 0, 19,
+    0x00, 0x90, 60, 100,                 /* t0: note on */
+    0x60, 0xff, 0x51, 3, 0x0f, 0x42, 0x40, /* t96: 1000000 us per quarter */
+    0x60, 0x80, 60, 0,                   /* t192: note off */
+    0x00, 0xff, 0x2f, 0,
+    'M', 'T', 'r', 'k', 0, 0, 0, 29,
+    0x00, 0xff, 0x21, 1, 2,              /* port 2 */
+    0x00, 0xf0, 2, 0x7e, 0xf7,           /* sysex */
+    0x60, 0xc1, 5,                       /* t96: program change */
+    0x00, 0x91, 64, 90,                  /* t96: note on */
+    0x30, 64, 0,                         /* t144: running status note "off" */
+    0x00, 0xff, 0x01, 1, 'x',            /* text */
+    0x00, 0xff, 0x2f, 0,
+};
+
+/* Running status used after a meta event */
+static const unsigned char runningAfterMeta[] = {
+    'M', 'T', 'h', 'd', 0, 0, 0, 6,  0, 0,  0, 1,  0, 96,
+    'M', 'T', 'r', 'k', 0, 0, 0, 16,
+    0x00, 0x90, 60, 100,                 /* note on */
+    0x00, 0xff, 0x01, 1, 'x',            /* text */
+    0x60, 60, 0,                         /* running status: not allowed */
+    0x00, 0xff, 0x2f, 0,
+};
+
+/* A note on whose velocity is a status byte */
+static const unsigned char statusAsData[] = {
+    'M', 'T', 'h', 'd', 0, 0, 0, 6,  0, 0,  0, 1,  0, 96,
+    'M', 'T', 'r', 'k', 0, 0, 0, 8,
+    0x00, 0x90, 60, 0x80,
+    0x00, 0xff, 0x2f, 0,
+};
+
+static int
+write_file(const unsigned char *data, size_t size)
+{
+    FILE *f = fopen(file, "wb");
+    if (!f) return -1;
+    fwrite(data, 1, size, f);
+    fclose(f);
+    return 0;
+}
+
+int main()
+{
+    d3h_midi_file_event_t *events;
+    const char *error = NULL;
+    int fd, count = 0, ok = 0;
+    static const double times[] = { 0.0, 0.5, 0.5, 1.0, 1.5 };
+    static const unsigned char status[] = { 0x90, 0xc1, 0x91, 0x91, 0x80 };
+    static const int ports[] = { 0, 2, 2, 2, 0 };
+    unsigned char bad[sizeof(smf)];
+    int i;
+
+    if ((fd = mkstemp(file)) < 0) {
+	printf("can't make a file %s:%d\n", __FILE__, __LINE__);
+	return 1;
+    }
+    close(fd);
+
+    /* tracks are merged in time order, through the tempo change */
+    write_file(smf, sizeof(smf));
+    events = d3h_midi_file_read(file, &count, &error);
+    if (!events || count != 5) {
+	printf("wrong event count %d (%s) %s:%d\n", count,
+	       error ? error : "no error", __FILE__, __LINE__);
+	goto done;
+    }
+    for (i = 0; i < count; i++) {
+	if (fabs(events[i].time - times[i]) > 1e-9 ||
+	    events[i].data[0] != status[i] || events[i].port != ports[i] ||
+	    events[i].size != (status[i] == 0xc1 ? 2 : 3)) {
+	    printf("wrong event %d %s:%d\n", i, __FILE__, __LINE__);
+	    goto done;
+	}
+    }
+    if (events[3].data[1] != 64 || events[3].data[2] != 0 ||
+	events[1].data[1] != 5) {
+	printf("wrong event data %s:%d\n", __FILE__, __LINE__);
+	goto done;
+    }
+    free(events);
+
+    /* a truncated file is refused */
+    write_file(smf, sizeof(smf) - 10);
+    events = d3h_midi_file_read(file, &count, &error);
+    if (events) {
+	printf("truncated file accepted %s:%d\n", __FILE__, __LINE__);
+	goto done;
+    }
+
+    /* a meta event cancels running status, so a data byte after one
+       is a damaged track */
+    write_file(runningAfterMeta, sizeof(runningAfterMeta));
+    if ((events = d3h_midi_file_read(file, &count, &error))) {
+	printf("running status after meta event accepted %s:%d\n",
+	       __FILE__, __LINE__);
+	goto done;
+    }
+
+    /* as is a status byte where a data byte should be */
+    write_file(statusAsData, sizeof(statusAsData));
+    if ((events = d3h_midi_file_read(file, &count, &error))) {
+	printf("status byte as data accepted %s:%d\n", __FILE__, __LINE__);
+	goto done;
+    }
+
+    /* and one timed in SMPTE frames at a rate there's no such thing as */
+    memcpy(bad, smf, sizeof(smf));
+    bad[12] = 0x100 - 23;
+    bad[13] = 4;
+    write_file(bad, sizeof(smf));
+    if ((events = d3h_midi_file_read(file, &count, &error))) {
+	printf("SMPTE file at 23 fps accepted %s:%d\n", __FILE__, __LINE__);
+	goto done;
+    }
+
+    /* or with no ticks in a frame */
+    bad[12] = 0x100 - 25;
+    bad[13] = 0;
+    write_file(bad, sizeof(smf));
+    if ((events = d3h_midi_file_read(file, &count, &error))) {
+	printf("SMPTE file with 0 ticks per frame accepted %s:%d\n",
+	       __FILE__, __LINE__);
+	goto done;
+    }
+
+    /* but a good SMPTE division is read: 25 fps, 40 ticks a frame */
+    bad[13] = 40;
+    write_file(bad, sizeof(smf));
+    events = d3h_midi_file_read(file, &count, &error);
+    if (!events || count != 5 || fabs(events[4].time - 0.192) > 1e-9) {
+	printf("SMPTE file misread %s:%d\n", __FILE__, __LINE__);
+	goto done;
+    }
+    free(events);
+
+    /* and so is something that isn't a MIDI file at all */
+    write_file((const unsigned char *)"RIFF\0\0\0\0WAVEfmt ", 16);
+    if ((events = d3h_midi_file_read(file, &count, &error))) {
+	printf("non-MIDI file accepted %s:%d\n", __FILE__, __LINE__);
+	goto done;
+    }
+
+    printf("test passed\n");
+    ok = 1;
+
+ done:
+    free(events);
+    unlink(file);
+
+    return ok ? 0 : 1;
+}
+
+/* vi:set ts=8 sts=4 sw=4: */